@@ -1,248 +1,5623 @@
+#define _GNU_SOURCE     /* memfd_create */
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <ncurses.h>
 
+#if !defined(DUOVM_NO_SIMD) && defined(__SSE2__)
+#include <emmintrin.h>
+#define DUOVM_SSE2 1
+#elif !defined(DUOVM_NO_SIMD) && defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define DUOVM_NEON 1
+#endif
+
+#if defined(DUOVM_PROFILE) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#endif
+
 #define MEM_SIZE 65536
 #define SRAM_START (224 * 256)
 
 #define SCREEN_W 36
 #define SCREEN_H 24
 
-uint8_t memory[MEM_SIZE];
+#define PAGE_SHIFT 8
+#define PAGE_COUNT (MEM_SIZE >> PAGE_SHIFT)
+
+#define KEYQ_SIZE 16            /* buttons queued ahead of 0xA0; power of two */
+
+/* Why a machine's dispatch loop handed control back early */
+#define STOP_INPUT 0x01         /* parked on 0xA0 with no button queued */
+#define STOP_TRAP  0x02         /* hit a trap, recorded in vm->trap */
+#define STOP_BREAK 0x04         /* reached a debugger breakpoint, not yet run */
+#define STOP_WATCH 0x08         /* stored to an address the debugger watches */
+
+/* Things a program can do that its machine can't carry on from */
+enum { TRAP_NONE, TRAP_ROM_WRITE, TRAP_UNDEFINED, TRAP_RUNAWAY };
+
+struct block;
+struct predecode;
+struct input_trace;
+struct profile;
+struct mem_stats;
+struct xtrace;
+struct session;
+
+/*
+ * A loaded program, shared read-only by every machine that runs it: the
+ * boot image (ROM plus initial SRAM) and the translations of its ROM code.
+ */
+typedef struct DuoROM {
+    uint8_t  image[MEM_SIZE];
+    uint16_t entry;
+    uint32_t rom_hash;          /* FNV-1a of the ROM half, checked by snapshots */
+    int      fd;                /* memfd holding image, or -1 */
+    struct predecode *code;     /* every ROM address decoded once, by PC */
+    bool     aot;               /* the ROM this binary was recompiled from */
+    _Atomic(struct block *) blocks[SRAM_START];
+} DuoROM;
+
+/*
+ * One Duo Navigator.  Everything a running program can observe or change
+ * lives here, so any number of machines can run side by side.
+ */
+typedef struct DuoVM {
+    /* CPU registers */
+    uint16_t PC;
+    uint16_t A;
+    uint16_t T;
+    uint8_t  D0;
+    uint8_t  D1;
+    uint16_t C;                 /* carry in bit 8; read it with carry() */
+
+    /* VM state */
+    bool running;
+    uint8_t stop;               /* STOP_* bits; dispatch returns while any is set */
+    bool halted;                /* stopped in a loop it can never leave */
+    uint64_t icount;            /* instructions executed by run_machine() */
+    uint64_t cycles;            /* emulated time, op_cycles[] per instruction */
+
+    /* Host side, since vm_new(), for the metrics line SIGUSR1 asks for */
+    double   born;
+    double   run_time;          /* in run() */
+    double   wait_time;         /* parked on 0xA0 waiting for a button */
+    uint64_t executed;
+    uint64_t flushes;           /* frames pushed to the terminal or a client */
+    unsigned metrics_seen;      /* the last request it answered */
+
+    /*
+     * With catch_traps (fuzzing), the first trap is recorded here and
+     * stops the machine instead of exiting the process
+     */
+    bool catch_traps;
+    uint8_t trap;               /* TRAP_* */
+    uint16_t trap_pc;           /* instruction that trapped */
+    uint16_t trap_addr;         /* ROM address written, or undefined opcode */
+    uint8_t *cover;             /* if set, marks every address executed */
+
+    /* Cursor */
+    uint8_t cur_x;
+    uint8_t cur_y;
+
+    /* Framebuffer, plus the cells written since the last terminal flush */
+    uint8_t  screen[SCREEN_H][SCREEN_W];
+    uint64_t dirty[SCREEN_H];
+
+    /* Button presses not yet read by 0xA0 */
+    uint8_t keyq[KEYQ_SIZE];
+    uint8_t keyq_head;
+    uint8_t keyq_tail;
+
+    /*
+     * Scripted input (-i), the trace being recorded (-r), and the last
+     * frame -d dumped, to diff against
+     */
+    const struct input_trace *trace;
+    size_t trace_pos;
+    bool trace_failed;          /* a timed trace stopped matching the run */
+    FILE *record;
+    bool dump_frames;
+    int frame;
+    uint8_t last_screen[SCREEN_H][SCREEN_W];
+    struct session *session;    /* the connection it serves, under -l */
+
+    /* Translations of code in this machine's SRAM */
+    struct block **sram_blocks;
+    struct block *cur_block;
+    uint16_t code_blocks[PAGE_COUNT];
 
-/* CPU registers */
-uint16_t PC = 0;
-uint16_t A = 0;
-uint16_t T = 0;
-uint8_t  D0 = 0;
-uint8_t  D1 = 0;
-bool     C = false;
+    uint8_t page_flags[PAGE_COUNT];
 
-/* VM state */
-bool running = true;
-bool waiting_key = false;
+    /*
+     * What the interpreter decodes ROM from: rom->code, or under -g the
+     * debugger's copy with its breakpoints patched in.  With watch set,
+     * a store to a marked SRAM byte stops the machine and is kept here.
+     */
+    const struct predecode *code;
+    const uint8_t *watch;
+    uint16_t watch_addr;
+    uint16_t watch_pc;
+    uint8_t  watch_old;
 
-/* Cursor */
-uint8_t cur_x = 0;
-uint8_t cur_y = 0;
+    /*
+     * Private copy-on-write mapping of rom->image: ROM pages stay shared
+     * with every other machine, only the SRAM pages it stores to get copied.
+     */
+    DuoROM  *rom;
+    uint8_t *memory;
+
+#ifdef DUOVM_PROFILE
+    struct profile *prof;
+#endif
+#ifdef DUOVM_EXEC_TRACE
+    struct xtrace *xtrace;      /* -x, on the single interactive machine */
+#endif
+#ifdef DUOVM_MEM_STATS
+    struct mem_stats *mstats;
+#endif
+} DuoVM;
+
+/*
+ * Terminal side of the framebuffer: what the terminal currently shows.
+ * The screen is pushed to ncurses at most FRAME_RATE times a second, or
+ * right before blocking on a key.  Only the single interactive machine
+ * ever talks to the terminal.
+ */
+#define FRAME_RATE 60
+static uint8_t shown[SCREEN_H][SCREEN_W];
+static struct timespec last_flush;
+
+/*
+ * Where a machine's screen goes and its buttons come from.  Machines only
+ * ever write their framebuffer, dirty bits and cursor (put_char_vm(),
+ * clear_screen_vm(), 0xA2/0xA3); a backend picks up the changed cells in
+ * flush(), as often as it likes, and fills in buttons when a machine
+ * waits for one.  Curses is the terminal, headless has neither (input
+ * comes from a script and the screen is dumped at the end), and net
+ * serves sessions over TCP (-l).
+ */
+struct display {
+    void (*open)(void);
+    void (*close)(void);
+    void (*flush)(DuoVM *vm);   /* send the dirty cells; NULL if nobody watches */
+    int (*button)(DuoVM *vm);   /* wait for the next button; -1 if none will come */
+};
+
+static const struct display display_curses, display_headless, display_net;
+static const struct display *display = &display_curses;
+
+static void shutdown_display(void) {
+    if (display->close)
+        display->close();
+}
+
+static void *xcalloc(size_t n, size_t size) {
+    void *p = calloc(n, size);
+    if (!p) {
+        shutdown_display();
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
 
 /* ================= Memory ================= */
 
+/*
+ * Per-page permissions for the 256 pages of 256 bytes.  The default build
+ * reads memory[] directly and write-protects ROM with one lookup in this
+ * table.  -DDUOVM_CHECKED_MEM brings back the fully checked accessors for
+ * debugging.
+ */
+#define PAGE_WRITE 0x01
+#define PAGE_CODE  0x02     /* SRAM page holding translated code */
+#define PAGE_WATCH 0x04     /* SRAM page with a debugger watchpoint */
+
+static void invalidate_code(DuoVM *vm, uint16_t addr);
+
+static void init_memory_map(DuoVM *vm) {
+    for (int p = 0; p < PAGE_COUNT; p++)
+        vm->page_flags[p] = (p << PAGE_SHIFT) >= SRAM_START ? PAGE_WRITE : 0;
+}
+
+static void describe_trap(FILE *f, int trap, uint16_t pc, uint16_t addr) {
+    switch (trap) {
+    case TRAP_ROM_WRITE: fprintf(f, "Write to ROM: %04X at %04X", addr, pc); break;
+    case TRAP_UNDEFINED: fprintf(f, "Undefined opcode %02X at %04X", addr, pc); break;
+    case TRAP_RUNAWAY:   fprintf(f, "Runaway: looping without input at %04X", pc); break;
+    }
+}
+
+/*
+ * A trap ends the process with a message, unless the machine catches
+ * traps: then the first one is kept for the harness and the machine stops
+ * once the trapping instruction is done.
+ */
+static void vm_trap(DuoVM *vm, int trap, uint16_t pc, uint16_t addr) {
+    if (!vm->catch_traps) {
+        shutdown_display();
+        describe_trap(stderr, trap, pc, addr);
+        fputc('\n', stderr);
+        exit(1);
+    }
+    if (!vm->trap) {
+        vm->trap = trap;
+        vm->trap_pc = pc;
+        vm->trap_addr = addr;
+    }
+    vm->stop |= STOP_TRAP;
+    vm->running = false;
+}
+
+/* Every opcode that stores is one byte long, so PC is just past it */
+static void rom_write_fault(DuoVM *vm, uint16_t addr) {
+    vm_trap(vm, TRAP_ROM_WRITE, vm->PC - 1, addr);
+}
+
+/* Anything but a plain writable page: ROM, or SRAM with cached code or a watchpoint */
+static void mem_write_slow(DuoVM *vm, uint16_t addr, uint8_t v) {
+    uint8_t f = vm->page_flags[addr >> PAGE_SHIFT];
+    if (!(f & PAGE_WRITE)) {
+        rom_write_fault(vm, addr);
+        return;
+    }
+    if (f & PAGE_CODE)
+        invalidate_code(vm, addr);
+    if ((f & PAGE_WATCH) && vm->watch[addr]) {
+        /* Like a ROM write, only ever from a one-byte store */
+        vm->watch_addr = addr;
+        vm->watch_pc = vm->PC - 1;
+        vm->watch_old = vm->memory[addr];
+        vm->stop |= STOP_WATCH;
+    }
+    vm->memory[addr] = v;
+}
+
+/*
+ * -DDUOVM_MEM_STATS counts every access through mem_read() and
+ * mem_write(): per page across the whole map, and per address in SRAM.
+ * Machines that have finished add their counts to heat_done.  Without
+ * the define MEM_COUNT() is empty, so a read stays a plain index.
+ */
+#ifdef DUOVM_MEM_STATS
+
+#define SRAM_SIZE (MEM_SIZE - SRAM_START)
+
+struct mem_stats {
+    uint64_t page_reads[PAGE_COUNT], page_writes[PAGE_COUNT];
+    uint64_t reads[SRAM_SIZE], writes[SRAM_SIZE];
+    int machines;               /* how many machines the counts cover */
+};
+
+static struct mem_stats heat_done;
+static pthread_mutex_t heat_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* idle_loop()'s probe has no counters: it looks ahead, it doesn't run */
+#define MEM_COUNT(vm, kind, addr)                                   \
+    do {                                                            \
+        struct mem_stats *s_ = (vm)->mstats;                        \
+        if (s_) {                                                   \
+            s_->page_##kind[(addr) >> PAGE_SHIFT]++;                \
+            if ((addr) >= SRAM_START)                               \
+                s_->kind[(addr) - SRAM_START]++;                    \
+        }                                                           \
+    } while (0)
+
+#else
+
+#define MEM_COUNT(vm, kind, addr) ((void)0)
+
+#endif /* DUOVM_MEM_STATS */
+
+#ifdef DUOVM_CHECKED_MEM
+
 static void check_addr(uint16_t addr) {
     if (addr >= MEM_SIZE) {
-        endwin();
+        shutdown_display();
         fprintf(stderr, "Memory OOB: %04X\n", addr);
         exit(1);
     }
 }
 
-static uint8_t mem_read(uint16_t addr) {
+static uint8_t mem_read(DuoVM *vm, uint16_t addr) {
     check_addr(addr);
-    return memory[addr];
+    MEM_COUNT(vm, reads, addr);
+    return vm->memory[addr];
 }
 
-static void mem_write(uint16_t addr, uint8_t v) {
+static void mem_write(DuoVM *vm, uint16_t addr, uint8_t v) {
     check_addr(addr);
+    MEM_COUNT(vm, writes, addr);
     if (addr < SRAM_START) {
-        endwin();
-        fprintf(stderr, "Write to ROM: %04X\n", addr);
-        exit(1);
+        rom_write_fault(vm, addr);
+        return;
     }
-    memory[addr] = v;
+    mem_write_slow(vm, addr, v);
+}
+
+#else
+
+/* A uint16_t can't index past the 64 KiB array, so reads need no check */
+static inline uint8_t mem_read(DuoVM *vm, uint16_t addr) {
+    MEM_COUNT(vm, reads, addr);
+    return vm->memory[addr];
+}
+
+static inline void mem_write(DuoVM *vm, uint16_t addr, uint8_t v) {
+    MEM_COUNT(vm, writes, addr);
+    if (vm->page_flags[addr >> PAGE_SHIFT] != PAGE_WRITE)
+        mem_write_slow(vm, addr, v);
+    else
+        vm->memory[addr] = v;
+}
+
+#endif /* DUOVM_CHECKED_MEM */
+
+/*
+ * Instruction bytes.  The same load as mem_read(), but kept apart so that
+ * -DDUOVM_MEM_STATS sees only the program's own loads and stores, whether
+ * the code runs interpreted or translated.
+ */
+static inline uint8_t fetch(const DuoVM *vm, uint16_t addr) {
+    return vm->memory[addr];
 }
 
-static uint16_t mem_read16(uint16_t addr) {
-    return mem_read(addr) | (mem_read(addr + 1) << 8);
+static inline uint16_t fetch16(const DuoVM *vm, uint16_t addr) {
+    return fetch(vm, addr) | (fetch(vm, addr + 1) << 8);
 }
 
 /* ================= Display ================= */
 
-static void clear_screen_vm(void) {
+static void clear_screen_vm(DuoVM *vm) {
+    memset(vm->screen, ' ', sizeof(vm->screen));
     for (int y = 0; y < SCREEN_H; y++)
-        for (int x = 0; x < SCREEN_W; x++)
-            mvaddch(y, x, ' ');
-    refresh();
+        vm->dirty[y] = (1ULL << SCREEN_W) - 1;
+}
+
+static void put_char_vm(DuoVM *vm, uint8_t ch) {
+    if (!ch) ch = ' ';
+    /* A2/A3 can park the cursor off-screen; the terminal clips, so do we */
+    if (vm->cur_y < SCREEN_H && vm->cur_x < SCREEN_W) {
+        vm->screen[vm->cur_y][vm->cur_x] = ch;
+        vm->dirty[vm->cur_y] |= 1ULL << vm->cur_x;
+    }
+    vm->cur_x++;
+    if (vm->cur_x >= SCREEN_W) {
+        vm->cur_x = 0;
+        vm->cur_y++;
+        if (vm->cur_y >= SCREEN_H)
+            vm->cur_y = 0;
+    }
+}
+
+/*
+ * Every cell must occupy exactly one terminal cell, or `shown` stops
+ * matching the terminal: ncurses would expand control bytes (^X, or a
+ * clear-to-EOL for '\n').
+ */
+static chtype term_glyph(uint8_t ch) {
+    if (ch == 0x7F) return ACS_BLOCK;
+    if (ch < 0x20 || ch > 0x7E) return ' ';
+    return ch;
 }
 
-static void put_char_vm(uint8_t ch) {
-    mvaddch(cur_y, cur_x, ch ? ch : ' ');
-    cur_x++;
-    if (cur_x >= SCREEN_W) {
-        cur_x = 0;
-        cur_y++;
-        if (cur_y >= SCREEN_H)
-            cur_y = 0;
+/* Send the changed cells to the terminal */
+static void flush_screen(DuoVM *vm) {
+    for (int y = 0; y < SCREEN_H; y++) {
+        uint64_t bits = vm->dirty[y];
+        vm->dirty[y] = 0;
+        for (int x = 0; bits; x++, bits >>= 1) {
+            if (!(bits & 1) || shown[y][x] == vm->screen[y][x])
+                continue;
+            shown[y][x] = vm->screen[y][x];
+            mvaddch(y, x, term_glyph(vm->screen[y][x]));
+        }
     }
     refresh();
+    vm->flushes++;
+    clock_gettime(CLOCK_MONOTONIC, &last_flush);
+}
+
+static void flush_screen_paced(DuoVM *vm) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long ns = (now.tv_sec - last_flush.tv_sec) * 1000000000LL +
+                   (now.tv_nsec - last_flush.tv_nsec);
+    if (ns >= 1000000000LL / FRAME_RATE)
+        display->flush(vm);
+}
+
+/* 0x7F is the Navigator's solid block; other control bytes show as '?' */
+static int dump_glyph(uint8_t ch) {
+    if (ch == 0x7F) return '#';
+    return isprint(ch) ? ch : '?';
+}
+
+static void dump_row(DuoVM *vm, FILE *f, int y) {
+    fputc('|', f);
+    for (int x = 0; x < SCREEN_W; x++)
+        fputc(dump_glyph(vm->screen[y][x]), f);
+    fputs("|\n", f);
+}
+
+static void dump_screen(DuoVM *vm, FILE *f) {
+    fprintf(f, "+%.*s+\n", SCREEN_W, "------------------------------------");
+    for (int y = 0; y < SCREEN_H; y++)
+        dump_row(vm, f, y);
+    fprintf(f, "+%.*s+\n", SCREEN_W, "------------------------------------");
+}
+
+/* Print only the rows that changed since the previous call */
+static void dump_screen_diff(DuoVM *vm, FILE *f) {
+    if (vm->frame == 0)
+        memset(vm->last_screen, ' ', sizeof(vm->last_screen));
+    fprintf(f, "@@ frame %d\n", vm->frame++);
+    for (int y = 0; y < SCREEN_H; y++) {
+        if (memcmp(vm->last_screen[y], vm->screen[y], SCREEN_W) == 0)
+            continue;
+        fprintf(f, "%02d", y);
+        dump_row(vm, f, y);
+    }
+    memcpy(vm->last_screen, vm->screen, sizeof(vm->last_screen));
+}
+
+/* ================= Metrics ================= */
+
+/*
+ * SIGUSR1 asks every running machine for one line on stderr:
+ * instructions and cycles, the rate while running, the share of a host
+ * thread it took, emulated against host time, the time spent waiting for
+ * a button in 0xA0, and frames flushed per second.  The handler only
+ * bumps metrics_asked; machines notice between bursts, or right away
+ * while the terminal machine waits for a key.  Emulated time is the
+ * cycle count at a nominal CYCLE_HZ.
+ */
+#define CYCLE_HZ 1000000
+
+static atomic_uint metrics_asked;
+
+static void metrics_signal(int sig) {
+    (void)sig;
+    atomic_fetch_add_explicit(&metrics_asked, 1, memory_order_relaxed);
+}
+
+/* True once per SIGUSR1 for each machine */
+static bool metrics_due(DuoVM *vm) {
+    unsigned asked = atomic_load_explicit(&metrics_asked, memory_order_relaxed);
+    if (asked == vm->metrics_seen)
+        return false;
+    vm->metrics_seen = asked;
+    return true;
+}
+
+static void metrics_line(FILE *f, const char *who, const DuoVM *vm, double waiting) {
+    double up = now_sec() - vm->born, emulated = (double)vm->cycles / CYCLE_HZ;
+    fprintf(f, "%s: %llu instructions, %llu cycles, %.1f M/s running, %.1f%% of a thread; "
+               "emulated %.3f s in %.3f s (x%.2f), %.3f s waiting on 0xA0, %.1f flushes/s\n",
+            who, (unsigned long long)vm->executed, (unsigned long long)vm->cycles,
+            vm->run_time > 0 ? vm->executed / vm->run_time / 1e6 : 0.0,
+            100 * vm->run_time / up, emulated, up, emulated / up,
+            vm->wait_time + waiting, vm->flushes / up);
 }
 
 /* ================= Input ================= */
 
-static int read_button(void) {
-    int c;
+/*
+ * 0xA0 never blocks: it takes the oldest queued button, or parks the
+ * machine on itself and returns to the host, which feeds buttons in with
+ * vm_feed_button() and runs it again.  Keys map to buttons the same way
+ * everywhere: arrows or a/w/s/d, Enter doubles as right.
+ */
+static int key_button(int c) {
+    switch (c) {
+        case KEY_LEFT:  return 0;
+        case KEY_UP:    return 1;
+        case KEY_DOWN:  return 2;
+        case KEY_RIGHT: return 3;
+        case 'a': return 0;
+        case 'w': return 1;
+        case 's': return 2;
+        case 'd': return 3;
+        case '\n': return 3;
+    }
+    return -1;
+}
+
+/* Queue button b (0-3); false if the queue is full */
+static bool vm_feed_button(DuoVM *vm, int b) {
+    if ((uint8_t)(vm->keyq_tail - vm->keyq_head) == KEYQ_SIZE)
+        return false;
+    vm->keyq[vm->keyq_tail++ % KEYQ_SIZE] = b;
+    return true;
+}
+
+/* Oldest queued button, or -1 */
+static int next_button(DuoVM *vm) {
+    if (vm->keyq_head == vm->keyq_tail)
+        return -1;
+    return vm->keyq[vm->keyq_head++ % KEYQ_SIZE];
+}
+
+/* Finish a parked 0xA0 if a button has arrived since */
+static bool resume_input(DuoVM *vm) {
+    int b = next_button(vm);
+    if (b < 0)
+        return false;
+    vm->PC++;
+    vm->stop &= ~STOP_INPUT;
+    mem_write(vm, vm->A, b);
+    return true;
+}
+
+/*
+ * -i takes a raw keystroke script or a trace recorded with -r:
+ *
+ *   duotrace 1 rom=1A2B3C4D
+ *   225689 d
+ *   225702 s
+ *
+ * Each line holds the instruction count of the 0xA0 that read a button
+ * (counted from boot, including that 0xA0) and the button's key.  Since
+ * the program only sees input at 0xA0, that pins the whole run: playback
+ * checks every read against the trace and stops at the first one that
+ * comes early or late.  Either kind is parsed once into an event list any
+ * number of machines can share.
+ */
+#define TRACE_MAGIC   "duotrace"
+#define TRACE_VERSION 1
+#define TRACE_KEYS    "awsd"        /* key written for each button */
+
+struct input_event {
+    uint64_t at;                /* 0xA0 instruction count, in traces */
+    uint8_t  button;
+};
+
+struct input_trace {
+    const char *path;
+    bool timed;                 /* a trace rather than a raw script */
+    uint32_t rom_hash;
+    size_t n;
+    struct input_event *ev;
+};
+
+static void trace_error(const char *path, int line, const char *why) {
+    fprintf(stderr, "%s:%d: %s\n", path, line, why);
+    exit(1);
+}
+
+static void trace_push(struct input_trace *t, uint64_t at, int button) {
+    if ((t->n & (t->n - 1)) == 0 && t->n >= 64) {
+        t->ev = realloc(t->ev, 2 * t->n * sizeof(*t->ev));
+        if (!t->ev) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    t->ev[t->n].at = at;
+    t->ev[t->n].button = button;
+    t->n++;
+}
+
+static struct input_trace *parse_input(const char *path, const char *buf, size_t len) {
+    struct input_trace *t = xcalloc(1, sizeof(*t));
+    t->path = path;
+    t->ev = xcalloc(64, sizeof(*t->ev));
+
+    if (len < strlen(TRACE_MAGIC) || memcmp(buf, TRACE_MAGIC, strlen(TRACE_MAGIC))) {
+        for (size_t i = 0; i < len; i++) {
+            int b = key_button((unsigned char)buf[i]);
+            if (b >= 0)
+                trace_push(t, 0, b);
+        }
+        return t;
+    }
+
+    t->timed = true;
+    const char *p = buf, *end = buf + len;
+    for (int line = 1; p < end; line++) {
+        const char *eol = memchr(p, '\n', end - p);
+        size_t n = (eol ? eol : end) - p;
+        char text[64], key, extra;
+        unsigned long long at;
+        unsigned version;
+
+        if (n >= sizeof(text))
+            trace_error(path, line, "line too long");
+        memcpy(text, p, n);
+        text[n] = '\0';
+        p += n + 1;
+
+        if (line == 1) {
+            if (sscanf(text, TRACE_MAGIC " %u rom=%x", &version, &t->rom_hash) != 2 ||
+                version != TRACE_VERSION)
+                trace_error(path, line, "unsupported trace header");
+        } else if (text[strspn(text, " \t\r")] && text[0] != '#') {
+            if (sscanf(text, "%llu %c %c", &at, &key, &extra) != 2 || !strchr(TRACE_KEYS, key))
+                trace_error(path, line, "expected `COUNT KEY`");
+            trace_push(t, at, strchr(TRACE_KEYS, key) - TRACE_KEYS);
+        }
+    }
+    return t;
+}
+
+/* Next button from the terminal; shows the screen and sleeps in poll() */
+static int terminal_button(DuoVM *vm) {
+    struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+    double since = now_sec();
+    int b, c;
+
+    flush_screen(vm);
     while (1) {
-        c = getch();
-        switch (c) {
-            case KEY_LEFT:  return 0;
-            case KEY_UP:    return 1;
-            case KEY_DOWN:  return 2;
-            case KEY_RIGHT: return 3;
-            case 'a': return 0;
-            case 'w': return 1;
-            case 's': return 2;
-            case 'd': return 3;
-            case '\n': return 3;
+        while ((c = getch()) != ERR) {
+            if ((b = key_button(c)) >= 0)
+                return b;
+        }
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno != EINTR)
+                return -1;
+            /* SIGUSR1: answer it now, not after the key */
+            if (metrics_due(vm))
+                metrics_line(stderr, "machine", vm, now_sec() - since);
         }
     }
 }
 
-/* ================= CPU ================= */
+static void curses_open(void) {
+    initscr();
+    noecho();
+    cbreak();
+    keypad(stdscr, TRUE);
+    nodelay(stdscr, TRUE);
+    curs_set(0);
+}
 
-static void write_alu_dest(uint8_t dest, uint8_t val) {
-    if (dest == 0)
-        mem_write(A, val);
-    else
-        D0 = val;
+static void curses_close(void) {
+    endwin();
+}
+
+static int no_button(DuoVM *vm) {
+    (void)vm;
+    return -1;
 }
 
-static void step(void) {
-    uint8_t opcode = mem_read(PC++);
+static const struct display display_curses = {
+    curses_open, curses_close, flush_screen, terminal_button,
+};
+
+static const struct display display_headless = {
+    NULL, NULL, NULL, no_button,
+};
 
-    /* COP */
-    if (opcode == 0x00) { A = mem_read16(PC); PC += 2; }
-    if (opcode == 0x01) { D0 = mem_read(PC++); }
-    if (opcode == 0x02) { D1 = mem_read(PC++); }
-    if (opcode == 0x03) { D0 = mem_read(A); }
-    if (opcode == 0x04) { D1 = mem_read(A); }
-    if (opcode == 0x05) { T = (T & 0xFF00) | mem_read(A); }
-    if (opcode == 0x06) { T = (T & 0x00FF) | (mem_read(A) << 8); }
-    if (opcode == 0x07) { A = T; }
-    if (opcode == 0x08) { PC = T; }
+/*
+ * Host side, for a machine parked on 0xA0: queue its next button, taken
+ * from the machine's script or trace while it lasts and then, for the
+ * terminal machine, from the keyboard.  Returns false once no more input
+ * will arrive, or when the run has drifted from the trace, which also
+ * sets vm->trace_failed.
+ */
+static bool wait_input(DuoVM *vm) {
+    const struct input_trace *t = vm->trace;
+    int b;
 
-    /* Jumps */
-    if (opcode == 0x20) PC = mem_read16(PC);
-    if (opcode == 0x21) {
-        uint16_t t = mem_read16(PC);
-        if (C) PC = t;
-        else PC += 2;
+    if (t && vm->trace_pos < t->n) {
+        const struct input_event *e = &t->ev[vm->trace_pos++];
+        if (t->timed && e->at != vm->icount) {
+            shutdown_display();
+            fprintf(stderr, "%s: event %zu is at instruction %llu but the machine read input at %llu\n",
+                    t->path, vm->trace_pos, (unsigned long long)e->at,
+                    (unsigned long long)vm->icount);
+            vm->trace_failed = true;
+            return false;
+        }
+        b = e->button;
+    } else if ((b = display->button(vm)) < 0) {
+        return false;
     }
-    if (opcode == 0x22) {
-        uint16_t t = mem_read16(PC);
-        if (!C) PC = t;
-        else PC += 2;
+
+    if (vm->record) {
+        fprintf(vm->record, "%llu %c\n", (unsigned long long)vm->icount, TRACE_KEYS[b]);
+        fflush(vm->record);
     }
+    return vm_feed_button(vm, b);
+}
+
+/* ================= Profiler ================= */
+
+/*
+ * -DDUOVM_PROFILE counts every instruction by PC and by opcode, and times
+ * the display calls behind 0xA1/0xA4.  There is no call instruction, so
+ * for folded stacks each run of code goes under a "frame" named after the
+ * address execution last jumped to.  Without the define the hooks expand
+ * to nothing.
+ */
+#ifdef DUOVM_PROFILE
+
+struct prof_edge {
+    uint32_t key;               /* frame << 16 | pc */
+    uint64_t count;             /* 0: free slot */
+};
 
-    /* Flags */
-    if (opcode == 0x40) C = false;
-    if (opcode == 0x41) C = true;
+struct profile {
+    uint64_t pc[MEM_SIZE];
+    uint8_t  pc_op[MEM_SIZE];   /* opcode last run at each PC */
+    uint64_t op[256];
+    uint64_t pair[256][256];    /* op followed by op, without a jump between */
+    uint64_t putc_calls, putc_ticks;
+    uint64_t cls_calls, cls_ticks;
+    uint16_t frame;             /* last jump target */
+    uint16_t expect;            /* PC after the previous instruction */
+    int      last_len;
+    struct prof_edge *edges;
+    size_t nedges, cap;
+};
 
-    uint8_t alu = opcode & 0xFE;
-    uint8_t dst = opcode & 1;
+#if defined(__x86_64__) || defined(__i386__)
+static inline uint64_t prof_clock(void) { return __rdtsc(); }
+#define PROF_TICKS "TSC ticks"
+#else
+static inline uint64_t prof_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#define PROF_TICKS "ns"
+#endif
 
-    if (alu == 0x60) write_alu_dest(dst, D0);
+static struct profile *prof_new(void) {
+    struct profile *p = xcalloc(1, sizeof(*p));
+    p->cap = 1024;
+    p->edges = xcalloc(p->cap, sizeof(*p->edges));
+    return p;
+}
 
-    if (alu == 0x62) {
-        uint16_t r = D0 + D1 + (C ? 1 : 0);
-        C = r > 0xFF;
-        write_alu_dest(dst, r & 0xFF);
+static void prof_free(struct profile *p) {
+    if (p) {
+        free(p->edges);
+        free(p);
     }
+}
 
-    if (alu == 0x64) {
-        int r = D0 - D1 - (C ? 1 : 0);
-        C = r < 0;
-        write_alu_dest(dst, r & 0xFF);
+static void prof_count_edge(struct profile *p, uint32_t key, uint64_t n) {
+    if (2 * (p->nedges + 1) > p->cap) {
+        struct prof_edge *old = p->edges;
+        size_t cap = p->cap;
+        p->cap *= 2;
+        p->edges = xcalloc(p->cap, sizeof(*p->edges));
+        p->nedges = 0;
+        for (size_t i = 0; i < cap; i++) {
+            if (old[i].count)
+                prof_count_edge(p, old[i].key, old[i].count);
+        }
+        free(old);
     }
+    size_t i = (key * 2654435761u) & (p->cap - 1);
+    while (p->edges[i].count && p->edges[i].key != key)
+        i = (i + 1) & (p->cap - 1);
+    if (!p->edges[i].count) {
+        p->edges[i].key = key;
+        p->nedges++;
+    }
+    p->edges[i].count += n;
+}
 
-    if (alu == 0x66) write_alu_dest(dst, D0 & D1);
-    if (alu == 0x68) write_alu_dest(dst, D0 | D1);
-    if (alu == 0x6A) write_alu_dest(dst, D0 ^ D1);
-    if (alu == 0x6C) write_alu_dest(dst, (~D0) & 0xFF);
+static void prof_insn(struct profile *p, uint16_t pc, uint8_t op, int len) {
+    p->pc[pc]++;
+    p->pc_op[pc] = op;
+    p->op[op]++;
+    if (pc != p->expect)
+        p->frame = pc;
+    else
+        p->pair[p->pc_op[(uint16_t)(pc - p->last_len)]][op]++;
+    p->last_len = len;
+    p->expect = pc + len;
+    prof_count_edge(p, (uint32_t)p->frame << 16 | pc, 1);
+}
 
-    if (alu == 0x6E) {
-        uint16_t r = (D0 << 1) | (C ? 1 : 0);
-        C = r > 0xFF;
-        write_alu_dest(dst, r & 0xFF);
+/* Add src's counts into dst */
+static void prof_merge(struct profile *dst, const struct profile *src) {
+    for (int i = 0; i < MEM_SIZE; i++) {
+        dst->pc[i] += src->pc[i];
+        if (src->pc[i])
+            dst->pc_op[i] = src->pc_op[i];
     }
+    for (int i = 0; i < 256; i++) {
+        dst->op[i] += src->op[i];
+        for (int j = 0; j < 256; j++)
+            dst->pair[i][j] += src->pair[i][j];
+    }
+    dst->putc_calls += src->putc_calls;
+    dst->putc_ticks += src->putc_ticks;
+    dst->cls_calls += src->cls_calls;
+    dst->cls_ticks += src->cls_ticks;
+    for (size_t i = 0; i < src->cap; i++) {
+        if (src->edges[i].count)
+            prof_count_edge(dst, src->edges[i].key, src->edges[i].count);
+    }
+}
+
+#define PROF_INSN(vm, pc, op) prof_insn((vm)->prof, (pc), (op), op_length[op])
+#define PROF_CALL(vm, what, call)                       \
+    do {                                                \
+        uint64_t t0_ = prof_clock();                    \
+        call;                                           \
+        (vm)->prof->what##_ticks += prof_clock() - t0_; \
+        (vm)->prof->what##_calls++;                     \
+    } while (0)
+
+#else
+
+#define PROF_INSN(vm, pc, op) ((void)0)
+#define PROF_CALL(vm, what, call) call
+
+#endif /* DUOVM_PROFILE */
+
+/* ================= Execution trace ================= */
 
-    if (alu == 0x70) {
-        bool nextC = D0 & 1;
-        uint8_t r = (D0 >> 1) | (C ? 0x80 : 0);
-        C = nextC;
-        write_alu_dest(dst, r);
+/*
+ * -DDUOVM_EXEC_TRACE adds -x FILE, a record of every instruction the
+ * machine runs: PC, opcode, the registers going into it and the byte it
+ * stored.  Every store is a one-byte opcode writing [A], so that byte is
+ * read back from memory when the next instruction starts.  The machine
+ * only fills the next slot of a ring buffer; a writer thread drains it,
+ * delta-compresses each entry against the one before and writes it out.
+ * A full ring makes the machine wait for the writer, so nothing is lost.
+ * -X FILE decodes a trace in any build.
+ *
+ * File: "DUOX", u16 version (1), u16 reserved, u32 ROM hash, then one
+ * record per instruction, starting from a previous record of all zeros:
+ *
+ *   flags   bits 0-1  PC minus the previous PC, if 1-3; 0: PC follows
+ *           bits 2-5  A, T, D0, D1 changed and follow
+ *           bit 6     C changed
+ *           bit 7     the byte stored at [A] follows
+ *   opcode
+ *   PC (2), A (2), T (2), D0, D1, stored byte, each only if flagged
+ */
+#define XTRACE_MAGIC   "DUOX"
+#define XTRACE_VERSION 1
+#define XTRACE_HEADER  12
+#define XTRACE_RECORD  11       /* longest record */
+
+/* Opcodes that store at [A]: the even ALU ops and 0xA0 */
+#define OP_STORES(code) (((code) >= 0x60 && (code) <= 0x70 && !((code) & 1)) || (code) == 0xA0)
+
+struct xtrace_entry {
+    uint16_t pc, a, t;
+    uint8_t  op, d0, d1;
+    bool     c;
+    bool     stored;
+    uint8_t  value;
+};
+
+#ifdef DUOVM_EXEC_TRACE
+
+#define XTRACE_RING 65536       /* entries; power of two */
+
+struct xtrace {
+    struct xtrace_entry ring[XTRACE_RING];
+    atomic_size_t head;         /* entries the machine has published */
+    atomic_size_t tail;         /* entries the writer is done with */
+    atomic_bool done;
+    bool pending;               /* ring[head] is filled but not published */
+    DuoVM *vm;
+    FILE *f;
+    const char *path;
+    pthread_t writer;
+    uint8_t buf[65536];         /* writer's output, XTRACE_RECORD slack */
+};
+
+static inline bool carry(const DuoVM *vm);
+
+/* Publish the instruction in progress, now that its store has happened */
+static inline void xtrace_publish(struct xtrace *x) {
+    size_t h = atomic_load_explicit(&x->head, memory_order_relaxed);
+    struct xtrace_entry *e = &x->ring[h % XTRACE_RING];
+    /* A ROM store never lands, and a parked 0xA0 hasn't stored yet */
+    e->stored = OP_STORES(e->op) && e->a >= SRAM_START && !(x->vm->stop & STOP_INPUT);
+    if (e->stored)
+        e->value = x->vm->memory[e->a];
+    atomic_store_explicit(&x->head, h + 1, memory_order_release);
+    x->pending = false;
+}
+
+static inline void xtrace_insn(DuoVM *vm, uint16_t pc, uint8_t op) {
+    struct xtrace *x = vm->xtrace;
+    if (!x)
+        return;
+    if (x->pending)
+        xtrace_publish(x);
+    size_t h = atomic_load_explicit(&x->head, memory_order_relaxed);
+    while (h - atomic_load_explicit(&x->tail, memory_order_acquire) == XTRACE_RING)
+        sched_yield();
+    x->ring[h % XTRACE_RING] = (struct xtrace_entry){
+        .pc = pc, .a = vm->A, .t = vm->T, .op = op, .d0 = vm->D0, .d1 = vm->D1, .c = carry(vm),
+    };
+    x->pending = true;
+}
+
+static size_t xtrace_encode(uint8_t *out, const struct xtrace_entry *prev, const struct xtrace_entry *e) {
+    uint8_t *p = out + 2;
+    uint16_t step = e->pc - prev->pc;
+    uint8_t flags = step <= 3 ? step : 0;
+
+    if (!flags) {
+        *p++ = e->pc;
+        *p++ = e->pc >> 8;
+    }
+    if (e->a != prev->a) {
+        flags |= 0x04;
+        *p++ = e->a;
+        *p++ = e->a >> 8;
+    }
+    if (e->t != prev->t) {
+        flags |= 0x08;
+        *p++ = e->t;
+        *p++ = e->t >> 8;
+    }
+    if (e->d0 != prev->d0) {
+        flags |= 0x10;
+        *p++ = e->d0;
+    }
+    if (e->d1 != prev->d1) {
+        flags |= 0x20;
+        *p++ = e->d1;
     }
+    if (e->c != prev->c)
+        flags |= 0x40;
+    if (e->stored) {
+        flags |= 0x80;
+        *p++ = e->value;
+    }
+    out[0] = flags;
+    out[1] = e->op;
+    return p - out;
+}
 
-    /* I/O */
-    if (opcode == 0xA0) {
-        waiting_key = true;
-        int b = read_button();
-        mem_write(A, b);
-        waiting_key = false;
+static void *xtrace_writer(void *arg) {
+    struct xtrace *x = arg;
+    struct xtrace_entry prev = {0};
+    size_t tail = 0, n = 0;
+
+    for (;;) {
+        bool done = atomic_load_explicit(&x->done, memory_order_acquire);
+        size_t head = atomic_load_explicit(&x->head, memory_order_acquire);
+        if (tail == head) {
+            if (done)
+                break;
+            nanosleep(&(struct timespec){ 0, 1000000 }, NULL);
+            continue;
+        }
+        for (; tail != head; tail++) {
+            if (n > sizeof(x->buf) - XTRACE_RECORD) {
+                fwrite(x->buf, 1, n, x->f);
+                n = 0;
+                atomic_store_explicit(&x->tail, tail, memory_order_release);
+            }
+            const struct xtrace_entry *e = &x->ring[tail % XTRACE_RING];
+            n += xtrace_encode(x->buf + n, &prev, e);
+            prev = *e;
+        }
+        atomic_store_explicit(&x->tail, tail, memory_order_release);
     }
+    fwrite(x->buf, 1, n, x->f);
+    return NULL;
+}
 
-    if (opcode == 0xA1) put_char_vm(mem_read(A));
-    if (opcode == 0xA2) cur_x = mem_read(A);
-    if (opcode == 0xA3) cur_y = mem_read(A);
-    if (opcode == 0xA4) clear_screen_vm();
+/* The trace being written, finished at exit so a trap's exit(1) keeps it */
+static struct xtrace *open_xtrace;
+
+static void xtrace_close(void) {
+    struct xtrace *x = open_xtrace;
+    if (!x)
+        return;
+    open_xtrace = NULL;
+    if (x->pending)
+        xtrace_publish(x);
+    atomic_store_explicit(&x->done, true, memory_order_release);
+    pthread_join(x->writer, NULL);
+    if (ferror(x->f) | fclose(x->f))
+        perror(x->path);
+    x->vm->xtrace = NULL;
+    free(x);
 }
 
-/* ================= Loader ================= */
+static void xtrace_open(DuoVM *vm, const char *path) {
+    struct xtrace *x = xcalloc(1, sizeof(*x));
+    uint8_t header[XTRACE_HEADER] = { 0 };
 
-static void load_hex(const char *path) {
-    FILE *f = fopen(path, "r");
-    if (!f) {
-        perror("open");
+    if (!(x->f = fopen(path, "wb"))) {
+        perror(path);
         exit(1);
     }
+    memcpy(header, XTRACE_MAGIC, 4);
+    header[4] = XTRACE_VERSION;
+    for (int i = 0; i < 4; i++)
+        header[8 + i] = vm->rom->rom_hash >> (8 * i);
+    fwrite(header, 1, sizeof(header), x->f);
 
-    char line[512];
-    while (fgets(line, sizeof(line), f)) {
-        if (!isxdigit(line[0])) continue;
+    x->vm = vm;
+    x->path = path;
+    atomic_init(&x->head, 0);
+    atomic_init(&x->tail, 0);
+    atomic_init(&x->done, false);
+    if (pthread_create(&x->writer, NULL, xtrace_writer, x)) {
+        perror("pthread_create");
+        exit(1);
+    }
+    vm->xtrace = x;
+    open_xtrace = x;
+    atexit(xtrace_close);
+}
 
-        uint16_t addr;
-        sscanf(line, "%hx:", &addr);
+#define XTRACE_INSN(vm, pc, op) xtrace_insn((vm), (pc), (op))
+/* Forget the instruction in progress: it stopped at a breakpoint */
+#define XTRACE_CANCEL(vm) ((vm)->xtrace ? (void)((vm)->xtrace->pending = false) : (void)0)
 
-        char *p = strchr(line, ':') + 1;
-        while (*p) {
-            while (*p == ' ') p++;
-            if (!isxdigit(p[0])) break;
+#else
 
-            unsigned v;
-            sscanf(p, "%02x", &v);
-            memory[addr++] = v;
-            p += 2;
-        }
-    }
-    fclose(f);
+#define XTRACE_INSN(vm, pc, op) ((void)0)
+#define XTRACE_CANCEL(vm) ((void)0)
+
+#endif /* DUOVM_EXEC_TRACE */
+
+/* ================= CPU ================= */
+
+/*
+ * Every ALU handler is generated per opcode, so `dest` is a constant and
+ * this folds to a plain store: D0, or [A] behind mem_write()'s page check.
+ */
+static inline void write_alu_dest(DuoVM *vm, uint8_t dest, uint8_t val) {
+    if (dest == 0)
+        mem_write(vm, vm->A, val);
+    else
+        vm->D0 = val;
 }
 
-/* ================= Main ================= */
+/*
+ * Opcode table.  One row per defined opcode:
+ *
+ *   X(opcode, name, length, cycles, assembly)
+ *
+ * `length` covers the opcode byte plus its inline operand.  The dispatcher
+ * fetches the operand and advances PC past the instruction before calling
+ * op_<name>(vm, operand), so jump handlers simply overwrite PC.  `cycles`
+ * is the instruction's cost in emulated time: one per byte fetched, plus
+ * one for the load or store at [A] if it makes one.  The disassembler
+ * prints `assembly` as a printf format, given the operand.  ALU ops name
+ * their destination: [A] for the even ones, D0 for the odd.
+ */
+#define DUO_OPCODES(X)                       \
+    X(0x00, lda,     3, 3, "lda %04X")      \
+    X(0x01, ldd0,    2, 2, "ldd0 %02X")     \
+    X(0x02, ldd1,    2, 2, "ldd1 %02X")     \
+    X(0x03, ldd0m,   1, 2, "ldd0 [A]")      \
+    X(0x04, ldd1m,   1, 2, "ldd1 [A]")      \
+    X(0x05, ldtl,    1, 2, "ldtl [A]")      \
+    X(0x06, ldth,    1, 2, "ldth [A]")      \
+    X(0x07, tta,     1, 1, "tta")           \
+    X(0x08, jmpt,    1, 1, "jmp T")         \
+    X(0x20, jmp,     3, 3, "jmp %04X")      \
+    X(0x21, jc,      3, 3, "jc %04X")       \
+    X(0x22, jnc,     3, 3, "jnc %04X")      \
+    X(0x40, clc,     1, 1, "clc")           \
+    X(0x41, sec,     1, 1, "sec")           \
+    X(0x60, mov_m,   1, 2, "mov [A]")       \
+    X(0x61, mov_d,   1, 1, "mov D0")        \
+    X(0x62, add_m,   1, 2, "add [A]")       \
+    X(0x63, add_d,   1, 1, "add D0")        \
+    X(0x64, sub_m,   1, 2, "sub [A]")       \
+    X(0x65, sub_d,   1, 1, "sub D0")        \
+    X(0x66, and_m,   1, 2, "and [A]")       \
+    X(0x67, and_d,   1, 1, "and D0")        \
+    X(0x68, or_m,    1, 2, "or [A]")        \
+    X(0x69, or_d,    1, 1, "or D0")         \
+    X(0x6A, xor_m,   1, 2, "xor [A]")       \
+    X(0x6B, xor_d,   1, 1, "xor D0")        \
+    X(0x6C, not_m,   1, 2, "not [A]")       \
+    X(0x6D, not_d,   1, 1, "not D0")        \
+    X(0x6E, rol_m,   1, 2, "rol [A]")       \
+    X(0x6F, rol_d,   1, 1, "rol D0")        \
+    X(0x70, ror_m,   1, 2, "ror [A]")       \
+    X(0x71, ror_d,   1, 1, "ror D0")        \
+    X(0xA0, in,      1, 2, "in [A]")        \
+    X(0xA1, putc,    1, 2, "putc [A]")      \
+    X(0xA2, setx,    1, 2, "setx [A]")      \
+    X(0xA3, sety,    1, 2, "sety [A]")      \
+    X(0xA4, cls,     1, 1, "cls")
+/* COP */
+static inline void op_lda(DuoVM *vm, uint16_t arg)  { vm->A = arg; }
+static inline void op_ldd0(DuoVM *vm, uint16_t arg) { vm->D0 = arg; }
+static inline void op_ldd1(DuoVM *vm, uint16_t arg) { vm->D1 = arg; }
+static inline void op_ldd0m(DuoVM *vm, uint16_t arg) { (void)arg; vm->D0 = mem_read(vm, vm->A); }
+static inline void op_ldd1m(DuoVM *vm, uint16_t arg) { (void)arg; vm->D1 = mem_read(vm, vm->A); }
+static inline void op_ldtl(DuoVM *vm, uint16_t arg) { (void)arg; vm->T = (vm->T & 0xFF00) | mem_read(vm, vm->A); }
+static inline void op_ldth(DuoVM *vm, uint16_t arg) { (void)arg; vm->T = (vm->T & 0x00FF) | (mem_read(vm, vm->A) << 8); }
+static inline void op_tta(DuoVM *vm, uint16_t arg)  { (void)arg; vm->A = vm->T; }
+static inline void op_jmpt(DuoVM *vm, uint16_t arg) { (void)arg; vm->PC = vm->T; }
 
-int main(int argc, char **argv) {
-    if (argc < 2) {
-        fprintf(stderr, "usage: %s program.hex\n", argv[0]);
-        return 1;
-    }
+/*
+ * Lazy carry.  Most carries are overwritten by the next ALU op, clc or
+ * sec before a jc/jnc looks at them, so the carrying ALU ops just keep
+ * their unmasked result in C, where the carry-out is bit 8, and only
+ * carry() pulls it out.
+ */
+static inline bool carry(const DuoVM *vm) { return vm->C >> 8 & 1; }
+static inline void set_carry(DuoVM *vm, bool c) { vm->C = c << 8; }
 
-    load_hex(argv[1]);
+/* Jumps */
+static inline void op_jmp(DuoVM *vm, uint16_t arg) { vm->PC = arg; }
+static inline void op_jc(DuoVM *vm, uint16_t arg)  { if (carry(vm)) vm->PC = arg; }
+static inline void op_jnc(DuoVM *vm, uint16_t arg) { if (!carry(vm)) vm->PC = arg; }
 
-    initscr();
-    noecho();
-    cbreak();
-    keypad(stdscr, TRUE);
-    nodelay(stdscr, FALSE);
-    curs_set(0);
+/* Flags */
+static inline void op_clc(DuoVM *vm, uint16_t arg) { (void)arg; set_carry(vm, false); }
+static inline void op_sec(DuoVM *vm, uint16_t arg) { (void)arg; set_carry(vm, true); }
+
+/* ALU: each operation computes its result (and carry) from D0/D1/C */
+static inline uint8_t alu_mov(DuoVM *vm) { return vm->D0; }
+
+static inline uint8_t alu_add(DuoVM *vm) {
+    return vm->C = vm->D0 + vm->D1 + carry(vm);
+}
 
-    clear_screen_vm();
+/* A borrow leaves bits 8 and up set */
+static inline uint8_t alu_sub(DuoVM *vm) {
+    return vm->C = vm->D0 - vm->D1 - carry(vm);
+}
+
+static inline uint8_t alu_and(DuoVM *vm) { return vm->D0 & vm->D1; }
+static inline uint8_t alu_or(DuoVM *vm)  { return vm->D0 | vm->D1; }
+static inline uint8_t alu_xor(DuoVM *vm) { return vm->D0 ^ vm->D1; }
+static inline uint8_t alu_not(DuoVM *vm) { return (~vm->D0) & 0xFF; }
+
+static inline uint8_t alu_rol(DuoVM *vm) {
+    return vm->C = vm->D0 << 1 | carry(vm);
+}
+
+static inline uint8_t alu_ror(DuoVM *vm) {
+    uint8_t r = vm->D0 >> 1 | carry(vm) << 7;
+    vm->C = vm->D0 << 8;
+    return r;
+}
+
+/* Even opcodes store the result at [A], odd ones into D0 */
+#define ALU_OP(name)                                                        \
+    static inline void op_##name##_m(DuoVM *vm, uint16_t arg) { (void)arg; write_alu_dest(vm, 0, alu_##name(vm)); } \
+    static inline void op_##name##_d(DuoVM *vm, uint16_t arg) { (void)arg; write_alu_dest(vm, 1, alu_##name(vm)); }
+
+ALU_OP(mov)
+ALU_OP(add)
+ALU_OP(sub)
+ALU_OP(and)
+ALU_OP(or)
+ALU_OP(xor)
+ALU_OP(not)
+ALU_OP(rol)
+ALU_OP(ror)
 
-    while (running) {
-        for (int i = 0; i < 20000 && !waiting_key; i++)
-            step();
+#undef ALU_OP
+
+/* I/O */
+static inline void op_in(DuoVM *vm, uint16_t arg) {
+    (void)arg;
+    if (vm->dump_frames)
+        dump_screen_diff(vm, stdout);
+    int b = next_button(vm);
+    if (b < 0) {
+        /* Nothing queued: park here until resume_input() finishes the read */
+        vm->PC--;
+        vm->stop |= STOP_INPUT;
+        return;
     }
+    mem_write(vm, vm->A, b);
+}
 
-    endwin();
-    return 0;
+static inline void op_putc(DuoVM *vm, uint16_t arg) { (void)arg; PROF_CALL(vm, putc, put_char_vm(vm, mem_read(vm, vm->A))); }
+static inline void op_setx(DuoVM *vm, uint16_t arg) { (void)arg; vm->cur_x = mem_read(vm, vm->A); }
+static inline void op_sety(DuoVM *vm, uint16_t arg) { (void)arg; vm->cur_y = mem_read(vm, vm->A); }
+static inline void op_cls(DuoVM *vm, uint16_t arg)  { (void)arg; PROF_CALL(vm, cls, clear_screen_vm(vm)); }
+
+/*
+ * Trap for every opcode not in DUO_OPCODES.  The original decoder fell
+ * through these as no-ops and program.hex relies on that (it executes
+ * 0xA5), so they stay no-ops unless built with -DDUOVM_TRAP_UNDEFINED.
+ */
+static void op_undefined(DuoVM *vm, uint8_t opcode) {
+#ifdef DUOVM_TRAP_UNDEFINED
+    vm_trap(vm, TRAP_UNDEFINED, vm->PC - 1, opcode);
+#else
+    (void)vm;
+    (void)opcode;
+#endif
+}
+
+#define OPERAND_1 0
+#define OPERAND_2 fetch(vm, vm->PC + 1)
+#define OPERAND_3 fetch16(vm, vm->PC + 1)
+
+/* Decode and execute a single instruction at PC */
+#define EXEC(name, len)                 \
+    do {                                \
+        uint16_t arg = OPERAND_##len;   \
+        vm->PC += len;                  \
+        op_##name(vm, arg);             \
+    } while (0)
+
+/* Instruction length and cycles per opcode; undefined opcodes are one byte */
+static uint8_t op_length[256];
+static uint8_t op_cycles[256];
+#define UNDEFINED_CYCLES 1
+
+static const char *const op_names[256] = {
+#define X(code, name, len, cyc, text) [code] = #name,
+    DUO_OPCODES(X)
+#undef X
+};
+
+static const char *op_name(uint8_t op) {
+    return op_names[op] ? op_names[op] : "undefined";
+}
+
+static const char *const op_asm[256] = {
+#define X(code, name, len, cyc, text) [code] = text,
+    DUO_OPCODES(X)
+#undef X
+};
+
+/* Print the instruction at pc as "0002  00 D2 EC  lda ECD2"; returns its length */
+static int disasm(FILE *f, const uint8_t *mem, uint16_t pc) {
+    uint8_t op = mem[pc];
+    int len = op_length[op];
+    uint16_t arg = len == 3 ? mem[(uint16_t)(pc + 1)] | mem[(uint16_t)(pc + 2)] << 8 :
+                   len == 2 ? mem[(uint16_t)(pc + 1)] : op;
+    char bytes[10] = "";
+
+    for (int i = 0; i < len; i++)
+        sprintf(bytes + 3 * i, "%02X ", mem[(uint16_t)(pc + i)]);
+    bytes[3 * len - 1] = '\0';
+    fprintf(f, "%04X  %-8s  ", pc, bytes);
+    if (op_asm[op])
+        fprintf(f, op_asm[op], arg);
+    else
+        fprintf(f, "db %02X", op);
+    return len;
+}
+
+/*
+ * ROM can't change once loaded, so rom_new() decodes the instruction at
+ * every ROM address up front and the interpreter dispatches from that
+ * instead of fetching opcode and operand bytes.  len 0 marks the few
+ * whose operand would run into SRAM; those, and all of SRAM, take the
+ * normal decoder.
+ */
+struct predecode {
+    uint8_t  op;
+    uint8_t  len;
+    uint16_t arg;       /* operand, or the opcode itself if undefined */
+};
+
+/*
+ * A debugger breakpoint, patched over the entry for its PC: 0xFF is no
+ * opcode and no real operand reaches 0x100, so dispatch takes it to the
+ * undefined handler, which is off the hot path.  Breakpoints cost nothing
+ * until one is hit.
+ */
+#define PRE_BREAK 0x100
+static const struct predecode break_entry = { 0xFF, 1, PRE_BREAK };
+
+/* Stop before a breakpoint's instruction; false for a real undefined opcode */
+static bool pre_break(DuoVM *vm, uint16_t arg) {
+    if (arg != PRE_BREAK)
+        return false;
+    vm->stop |= STOP_BREAK;
+    XTRACE_CANCEL(vm);          /* the profiler has counted it, though */
+    return true;
+}
+
+/*
+ * Dispatch.  GCC and Clang get threaded code through computed goto;
+ * everything else (or -DDUOVM_NO_THREADED) indexes a 256-entry handler
+ * table.  Both run the same op_* handlers.
+ */
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(DUOVM_NO_THREADED)
+#define DUOVM_THREADED 1
+#endif
+
+#ifdef DUOVM_THREADED
+
+/*
+ * GCC otherwise merges every handler's `goto *labels[...]` into one shared
+ * indirect jump, which throws away what threading buys: a branch-target
+ * prediction per handler.
+ */
+#if defined(__GNUC__) && !defined(__clang__)
+#define DISPATCH_LOOP __attribute__((optimize("no-crossjumping", "no-gcse")))
+#else
+#define DISPATCH_LOOP
+#endif
+
+/*
+ * Label table for a threaded dispatch loop: every slot traps, then the
+ * defined opcodes override theirs (a GNU range initializer, like the
+ * computed goto itself).
+ */
+#define X_LABEL(code, name, len, cyc, text) [code] = &&l_##name,
+#define DISPATCH_LABELS(var)                                            \
+    _Pragma("GCC diagnostic push")                                      \
+    _Pragma("GCC diagnostic ignored \"-Woverride-init\"")              \
+    static void *const var[256] = {                                     \
+        [0 ... 255] = &&l_undefined, DUO_OPCODES(X_LABEL)               \
+    };                                                                  \
+    _Pragma("GCC diagnostic pop")
+
+/* Handler labels for pre-decoded ROM instructions */
+#define X_PRE_LABEL(code, name, len, cyc, text) [code] = &&p_##name,
+#define PREDECODE_LABELS(var)                                           \
+    _Pragma("GCC diagnostic push")                                      \
+    _Pragma("GCC diagnostic ignored \"-Woverride-init\"")              \
+    static void *const var[256] = {                                     \
+        [0 ... 255] = &&p_undefined, DUO_OPCODES(X_PRE_LABEL)           \
+    };                                                                  \
+    _Pragma("GCC diagnostic pop")
+
+/* Plain decode-and-dispatch; same contract as run() */
+DISPATCH_LOOP static long interp_run(DuoVM *vm, long n) {
+    const long budget = n;
+    const struct predecode *code = vm->code;
+    uint16_t arg = 0;
+    DISPATCH_LABELS(labels)
+    PREDECODE_LABELS(pre_labels)
+
+#define NEXT()                                                          \
+    do {                                                                \
+        if (--n < 0 || vm->stop) goto out;                              \
+        PROF_INSN(vm, vm->PC, fetch(vm, vm->PC));                       \
+        XTRACE_INSN(vm, vm->PC, fetch(vm, vm->PC));                     \
+        if (vm->PC < SRAM_START && code[vm->PC].len) {                  \
+            const struct predecode *d_ = &code[vm->PC];                 \
+            arg = d_->arg;                                              \
+            goto *pre_labels[d_->op];                                   \
+        }                                                               \
+        goto *labels[fetch(vm, vm->PC)];                                \
+    } while (0)
+
+    NEXT();
+#define X(code, name, len, cyc, text) l_##name: vm->cycles += cyc; EXEC(name, len); NEXT();
+    DUO_OPCODES(X)
+#undef X
+l_undefined:
+    vm->cycles += UNDEFINED_CYCLES;
+    op_undefined(vm, fetch(vm, vm->PC++));
+    NEXT();
+#define X(code, name, len, cyc, text) \
+    p_##name: vm->cycles += cyc; vm->PC += len; op_##name(vm, arg); NEXT();
+    DUO_OPCODES(X)
+#undef X
+p_undefined:
+    if (pre_break(vm, arg))
+        goto out;       /* as if it had stopped just before */
+    vm->cycles += UNDEFINED_CYCLES;
+    vm->PC++;
+    op_undefined(vm, arg);
+    NEXT();
+#undef NEXT
+out:
+    return budget - n - 1;
+}
+
+#else
+
+typedef void (*op_handler)(DuoVM *vm);
+
+#define X(code, name, len, cyc, text) \
+    static void exec_##name(DuoVM *vm) { vm->cycles += cyc; EXEC(name, len); }
+DUO_OPCODES(X)
+#undef X
+
+static void exec_undefined(DuoVM *vm) {
+    vm->cycles += UNDEFINED_CYCLES;
+    op_undefined(vm, fetch(vm, vm->PC++));
+}
+
+static op_handler dispatch[256];
+
+/*
+ * Same for pre-decoded ROM.  Each handler steps PC by its own constant
+ * length, so PC never waits on the load from the decode array.
+ */
+typedef void (*pre_handler)(DuoVM *vm, uint16_t arg);
+
+#define X(code, name, len, cyc, text) \
+    static void pre_##name(DuoVM *vm, uint16_t arg) { vm->cycles += cyc; vm->PC += len; op_##name(vm, arg); }
+DUO_OPCODES(X)
+#undef X
+
+static void pre_undefined(DuoVM *vm, uint16_t arg) {
+    if (pre_break(vm, arg))
+        return;
+    vm->cycles += UNDEFINED_CYCLES;
+    vm->PC++;
+    op_undefined(vm, arg);
+}
+
+static pre_handler pre_dispatch[256];
+
+static void step(DuoVM *vm) {
+    PROF_INSN(vm, vm->PC, fetch(vm, vm->PC));
+    XTRACE_INSN(vm, vm->PC, fetch(vm, vm->PC));
+    if (vm->PC < SRAM_START && vm->code[vm->PC].len) {
+        const struct predecode *d = &vm->code[vm->PC];
+        pre_dispatch[d->op](vm, d->arg);
+        return;
+    }
+    dispatch[fetch(vm, vm->PC)](vm);
+}
+
+/* Plain decode-and-dispatch; same contract as run() */
+static long interp_run(DuoVM *vm, long n) {
+    long i;
+    for (i = 0; i < n && !vm->stop; i++)
+        step(vm);
+    /* Only the last step can have hit a breakpoint, and it didn't run */
+    if (i && (vm->stop & STOP_BREAK))
+        i--;
+    return i;
+}
+
+#endif /* DUOVM_THREADED */
+
+/* ================= Translation cache ================= */
+
+/*
+ * Straight-line runs of code are decoded once into blocks of micro-ops,
+ * ending at the first 0x08/0x20/0x21/0x22 or after BLOCK_MAX instructions,
+ * and looked up by their start PC.
+ *
+ * A block never spans the ROM/SRAM boundary.  ROM blocks only depend on
+ * ROM, so they go into the DuoROM that all machines running it share;
+ * threads publish to that table and never change it.  SRAM blocks belong
+ * to their machine and mark their pages PAGE_CODE, so that a store into
+ * them goes through mem_write_slow() and drops the stale translation.
+ */
+#define BLOCK_MAX       64
+#define BLOCK_MAX_BYTES (BLOCK_MAX * 3)
+
+/*
+ * Superinstructions: adjacent pairs translate() folds into one micro-op,
+ * so they cost one dispatch.  These are the top straight-line pairs in
+ * the -DDUOVM_PROFILE report for program.hex over a long key script.
+ * Neither first half stores, so a store by the second half still drops
+ * a stale block right where an unfused one would.  Profiling and tracing
+ * builds don't fuse, so that they see every instruction.
+ *
+ *   X(first opcode, name, second opcode, name)
+ */
+#define DUO_FUSED(X)                    \
+    X(0x00, lda,   0x03, ldd0m)         \
+    X(0x00, lda,   0x60, mov_m)         \
+    X(0x00, lda,   0x04, ldd1m)         \
+    X(0x00, lda,   0x05, ldtl)          \
+    X(0x00, lda,   0x06, ldth)          \
+    X(0x40, clc,   0x02, ldd1)          \
+    X(0x41, sec,   0x02, ldd1)          \
+    X(0x03, ldd0m, 0x63, add_d)         \
+    X(0x03, ldd0m, 0x62, add_m)
+
+/* Micro-op codes past the 256 opcodes */
+enum {
+    UOP_FUSED_BASE = 255,
+#define X(c1, n1, c2, n2) UOP_##n1##__##n2,
+    DUO_FUSED(X)
+#undef X
+    UOP_COUNT
+};
+
+struct uop {
+    uint16_t op;        /* opcode or UOP_* superinstruction */
+    uint16_t arg;       /* operand, or the opcode itself if undefined */
+    uint16_t arg2;      /* operand of a superinstruction's second half */
+    uint16_t next;      /* PC after this micro-op */
+    uint8_t  insns;     /* instructions in the block up to this one */
+};
+
+/* Native code for hot ROM blocks; see the JIT below */
+#if defined(__x86_64__) && defined(__linux__) && !defined(DUOVM_NO_JIT) && \
+    !defined(DUOVM_PROFILE) && !defined(DUOVM_EXEC_TRACE) && !defined(DUOVM_CHECKED_MEM) && \
+    !defined(DUOVM_MEM_STATS)
+#define DUOVM_JIT 1
+typedef long (*jit_fn)(DuoVM *vm);
+#endif
+
+struct block {
+    uint16_t pc;
+    uint16_t bytes;
+    bool     stale;
+    int      n;         /* micro-ops */
+    int      insns;     /* instructions they stand for */
+    uint16_t cycles[BLOCK_MAX + 1];     /* of the first k instructions */
+#ifdef DUOVM_JIT
+    atomic_uint hits;   /* entries so far, until it is compiled */
+    _Atomic(jit_fn) native;
+#endif
+    struct uop ops[];
+};
+
+static bool use_tc = true;
+static bool use_jit = true;
+
+/* Run the recompiled ROM (-A) when this is an AOT build of it */
+static bool use_aot = true;
+
+#ifdef DUOVM_AOT
+#if defined(DUOVM_PROFILE) || defined(DUOVM_EXEC_TRACE)
+#error "recompiled code has no profiling or tracing hooks"
+#endif
+/* Both in the file -A wrote, which includes this one */
+static const uint32_t aot_rom_hash;
+static long aot_run(DuoVM *vm, long n);
+#endif
+
+static bool ends_block(uint8_t op) {
+    return op == 0x08 || op == 0x20 || op == 0x21 || op == 0x22;
+}
+
+/* Superinstruction for micro-op `first` followed by opcode `second`, or -1 */
+static int fused_op(uint16_t first, uint8_t second) {
+#if !defined(DUOVM_PROFILE) && !defined(DUOVM_EXEC_TRACE)
+#define X(c1, n1, c2, n2) if (first == c1 && second == c2) return UOP_##n1##__##n2;
+    DUO_FUSED(X)
+#undef X
+#endif
+    (void)first;
+    (void)second;
+    return -1;
+}
+
+/* Returns NULL if not even the first instruction fits in its region */
+static struct block *translate(DuoVM *vm, uint16_t pc) {
+    struct block *b = xcalloc(1, sizeof(*b) + BLOCK_MAX * sizeof(struct uop));
+    uint32_t limit = pc < SRAM_START ? SRAM_START : MEM_SIZE;
+    uint32_t end = pc;
+
+    b->pc = pc;
+    b->stale = false;
+    b->n = 0;
+    b->insns = 0;
+    while (b->insns < BLOCK_MAX) {
+        uint8_t op = fetch(vm, end);
+        unsigned len = op_length[op];
+        if (end + len > limit)
+            break;
+
+        uint16_t arg = len == 3 ? fetch16(vm, end + 1) :
+                       len == 2 ? fetch(vm, end + 1) : op;
+        struct uop *u = b->n ? &b->ops[b->n - 1] : NULL;
+        int fused = u ? fused_op(u->op, op) : -1;
+        if (fused >= 0) {
+            u->op = fused;
+            u->arg2 = arg;
+        } else {
+            u = &b->ops[b->n++];
+            u->op = op;
+            u->arg = arg;
+        }
+        end += len;
+        u->next = end;
+        u->insns = ++b->insns;
+        b->cycles[b->insns] = b->cycles[b->insns - 1] + op_cycles[op];
+        if (ends_block(op))
+            break;
+    }
+    b->bytes = end - pc;
+    if (!b->n) {
+        free(b);
+        return NULL;
+    }
+
+    if (pc < SRAM_START) {
+        struct block *expected = NULL;
+        if (!atomic_compare_exchange_strong(&vm->rom->blocks[pc], &expected, b)) {
+            free(b);
+            return expected;    /* another thread got there first */
+        }
+        return b;
+    }
+
+    if (!vm->sram_blocks)
+        vm->sram_blocks = xcalloc(MEM_SIZE - SRAM_START, sizeof(*vm->sram_blocks));
+    for (uint32_t p = pc >> PAGE_SHIFT; p <= (end - 1) >> PAGE_SHIFT; p++) {
+        vm->code_blocks[p]++;
+        vm->page_flags[p] |= PAGE_CODE;
+    }
+    vm->sram_blocks[pc - SRAM_START] = b;
+    return b;
+}
+
+static void drop_block(DuoVM *vm, struct block *b) {
+    uint32_t end = b->pc + b->bytes;
+    for (uint32_t p = b->pc >> PAGE_SHIFT; p <= (end - 1) >> PAGE_SHIFT; p++) {
+        if (--vm->code_blocks[p] == 0)
+            vm->page_flags[p] &= ~PAGE_CODE;
+    }
+    vm->sram_blocks[b->pc - SRAM_START] = NULL;
+    /* A block can overwrite itself; tc_run() frees it once it returns */
+    if (b == vm->cur_block)
+        b->stale = true;
+    else
+        free(b);
+}
+
+/* Drop every SRAM block whose bytes include addr */
+static void invalidate_code(DuoVM *vm, uint16_t addr) {
+    for (int back = 0; back < BLOCK_MAX_BYTES && addr - back >= SRAM_START; back++) {
+        struct block *b = vm->sram_blocks[addr - back - SRAM_START];
+        if (b && back < b->bytes)
+            drop_block(vm, b);
+    }
+}
+
+#ifdef DUOVM_THREADED
+
+/* Labels for every micro-op: the opcodes, then the superinstructions */
+#define X_FUSED_LABEL(c1, n1, c2, n2) [UOP_##n1##__##n2] = &&l_##n1##__##n2,
+#define UOP_LABELS(var)                                                 \
+    _Pragma("GCC diagnostic push")                                      \
+    _Pragma("GCC diagnostic ignored \"-Woverride-init\"")              \
+    static void *const var[UOP_COUNT] = {                               \
+        [0 ... 255] = &&l_undefined, DUO_OPCODES(X_LABEL)               \
+        DUO_FUSED(X_FUSED_LABEL)                                        \
+    };                                                                  \
+    _Pragma("GCC diagnostic pop")
+
+/*
+ * Run b until it ends, stops (input or a trap) or goes stale; returns
+ * the number of instructions executed.
+ */
+DISPATCH_LOOP static long exec_block(DuoVM *vm, struct block *b) {
+    UOP_LABELS(labels)
+
+    const struct uop *u = b->ops;
+    const struct uop *end = u + b->n;
+    uint16_t arg;
+
+#define NEXT()                                                  \
+    do {                                                        \
+        if (u == end || vm->stop || b->stale) goto out;         \
+        PROF_INSN(vm, u->next - op_length[u->op], u->op);       \
+        XTRACE_INSN(vm, u->next - op_length[u->op], u->op);     \
+        vm->PC = u->next;                                       \
+        arg = u->arg;                                           \
+        goto *labels[(u++)->op];                                \
+    } while (0)
+
+    NEXT();
+#define X(code, name, len, cyc, text) l_##name: op_##name(vm, arg); NEXT();
+    DUO_OPCODES(X)
+#undef X
+#define X(c1, n1, c2, n2) l_##n1##__##n2: op_##n1(vm, arg); op_##n2(vm, u[-1].arg2); NEXT();
+    DUO_FUSED(X)
+#undef X
+l_undefined:
+    op_undefined(vm, arg);
+    NEXT();
+#undef NEXT
+out:
+    return u == b->ops ? 0 : u[-1].insns;
+}
+
+#else
+
+typedef void (*uop_handler)(DuoVM *vm, uint16_t arg);
+
+static void uop_undefined(DuoVM *vm, uint16_t arg) {
+    op_undefined(vm, arg);
+}
+
+static uop_handler uop_dispatch[256];
+
+typedef void (*fused_handler)(DuoVM *vm, uint16_t arg, uint16_t arg2);
+
+#define X(c1, n1, c2, n2) \
+    static void fused_##n1##__##n2(DuoVM *vm, uint16_t arg, uint16_t arg2) { op_##n1(vm, arg); op_##n2(vm, arg2); }
+DUO_FUSED(X)
+#undef X
+
+static const fused_handler fused_dispatch[UOP_COUNT - 256] = {
+#define X(c1, n1, c2, n2) [UOP_##n1##__##n2 - 256] = fused_##n1##__##n2,
+    DUO_FUSED(X)
+#undef X
+};
+
+static long exec_block(DuoVM *vm, struct block *b) {
+    const struct uop *u = b->ops;
+    const struct uop *end = u + b->n;
+    while (u < end && !vm->stop && !b->stale) {
+        PROF_INSN(vm, u->next - op_length[u->op], u->op);
+        XTRACE_INSN(vm, u->next - op_length[u->op], u->op);
+        vm->PC = u->next;
+        if (u->op < 256)
+            uop_dispatch[u->op](vm, u->arg);
+        else
+            fused_dispatch[u->op - 256](vm, u->arg, u->arg2);
+        u++;
+    }
+    return u == b->ops ? 0 : u[-1].insns;
+}
+
+#endif /* DUOVM_THREADED */
+
+#ifdef DUOVM_JIT
+
+/*
+ * JIT.  A ROM block entered JIT_HOT times is compiled to x86-64 and run
+ * natively from then on.  Only ROM blocks qualify, since they never go
+ * stale.  For the whole block A, T, D0 and D1 live in callee-saved
+ * registers and the carry in r11 as 0 or 1, which is what the host's own
+ * ADC, SBB, RCL and RCR take and leave in CF: out of bit 8 for add, the
+ * borrow for sub, and the bit shifted out for the rotates.  They go back
+ * to the DuoVM on the way out and before every call.
+ *
+ * A store tests the page flags inline and does a plain move on a plain
+ * SRAM page; anything else goes to mem_write_slow().  0xA0, 0xA1 and
+ * 0xA4 call their handlers, and the block leaves wherever vm->stop may
+ * have been set, with PC just past that instruction, like exec_block().
+ *
+ * The code goes into a memfd mapped twice, writable for the compiler and
+ * executable for the machines, so no page is ever both.  Blocks only ever
+ * get added to it, and compiling takes jit_arena.lock.  Other hosts,
+ * AArch64 included, and profiling, tracing and checked builds keep
+ * running blocks in exec_block().
+ */
+#define JIT_HOT   64
+#define JIT_ARENA (16 << 20)
+#define JIT_MAX   (BLOCK_MAX * 160 + 256)  /* code for one block, at most */
+
+static struct {
+    pthread_mutex_t lock;
+    bool     tried;
+    uint8_t *rw;        /* both views of the memfd, or NULL */
+    uint8_t *rx;
+    size_t   used;
+} jit_arena = { PTHREAD_MUTEX_INITIALIZER, false, NULL, NULL, 0 };
+
+enum { X_RAX, X_RCX, X_RDX, X_RBX, X_RSP, X_RBP, X_RSI, X_RDI,
+       X_R8, X_R9, X_R10, X_R11, X_R12, X_R13, X_R14, X_R15 };
+
+/* Where compiled code keeps the machine */
+#define J_VM  X_RBX
+#define J_MEM X_RBP     /* vm->memory */
+#define J_A   X_R12
+#define J_T   X_R13
+#define J_D0  X_R14
+#define J_D1  X_R15
+#define J_C   X_R11
+
+/* Operand sizes for x86_op(); the default is 32 bits, or 8 for byte opcodes */
+#define X86_W  0x1      /* REX.W */
+#define X86_16 0x2      /* 0x66 */
+
+struct x86 {
+    uint8_t *p;
+    const uint8_t *epilogue;
+};
+
+#define VM_OFF(field) ((int32_t)offsetof(DuoVM, field))
+
+static void x86_imm(struct x86 *x, uint64_t v, int bytes) {
+    while (bytes--) {
+        *x->p++ = v;
+        v >>= 8;
+    }
+}
+
+/* Prefix, REX and opcode (one or two bytes) for ModRM fields reg, index and base */
+static void x86_op(struct x86 *x, unsigned size, unsigned op, int reg, int index, int base) {
+    unsigned rex = (size & X86_W ? 8 : 0) | (reg >> 3 & 1) << 2 |
+                   (index >= 0 ? (index >> 3 & 1) << 1 : 0) | (base >> 3 & 1);
+    if (size & X86_16)
+        *x->p++ = 0x66;
+    if (rex)
+        *x->p++ = 0x40 | rex;
+    if (op > 0xFF)
+        *x->p++ = op >> 8;
+    *x->p++ = op;
+}
+
+/* op reg, rm with both in registers; reg is the /digit for group opcodes */
+static void x86_rr(struct x86 *x, unsigned size, unsigned op, int reg, int rm) {
+    x86_op(x, size, op, reg, -1, rm);
+    *x->p++ = 0xC0 | (reg & 7) << 3 | (rm & 7);
+}
+
+/* op reg, [base + index + disp]; base is never rsp or r12 */
+static void x86_rm(struct x86 *x, unsigned size, unsigned op, int reg, int base, int index,
+                   int32_t disp) {
+    x86_op(x, size, op, reg, index, base);
+    if (index < 0) {
+        *x->p++ = 0x80 | (reg & 7) << 3 | (base & 7);
+    } else {
+        *x->p++ = 0x84 | (reg & 7) << 3;
+        *x->p++ = (index & 7) << 3 | (base & 7);
+    }
+    x86_imm(x, (uint32_t)disp, 4);
+}
+
+static void x86_mov_imm(struct x86 *x, int reg, uint32_t v) {
+    x86_op(x, 0, 0xB8 + (reg & 7), 0, -1, reg);
+    x86_imm(x, v, 4);
+}
+
+static void x86_push_pop(struct x86 *x, unsigned op, int reg) {
+    x86_op(x, 0, op + (reg & 7), 0, -1, reg);
+}
+
+/* Forward jcc/jmp rel32 (cc < 0 for jmp); x86_patch() points it here */
+static uint8_t *x86_jump(struct x86 *x, int cc) {
+    if (cc < 0)
+        *x->p++ = 0xE9;
+    else {
+        *x->p++ = 0x0F;
+        *x->p++ = 0x80 + cc;
+    }
+    x->p += 4;
+    return x->p;
+}
+
+static void x86_patch(struct x86 *x, uint8_t *after) {
+    int32_t rel = x->p - after;
+    memcpy(after - 4, &rel, 4);
+}
+
+#define CC_E  0x4
+#define CC_NE 0x5
+
+static void jit_spill_carry(struct x86 *x) {
+    x86_rr(x, 0, 0x89, J_C, X_RCX);                     /* mov ecx, r11d */
+    x86_rr(x, 0, 0xC1, 4, X_RCX);                       /* shl ecx, 8 */
+    *x->p++ = 8;
+    x86_rm(x, X86_16, 0x89, X_RCX, J_VM, -1, VM_OFF(C));
+}
+
+static void jit_load_carry(struct x86 *x) {
+    x86_rm(x, 0, 0x0FB7, J_C, J_VM, -1, VM_OFF(C));     /* movzx r11d, word [C] */
+    x86_rr(x, 0, 0xC1, 5, J_C);                         /* shr r11d, 8 */
+    *x->p++ = 8;
+    x86_rr(x, 0, 0x83, 4, J_C);                         /* and r11d, 1 */
+    *x->p++ = 1;
+}
+
+/* Leave with count instructions done and PC = pc, or as already set if pc < 0 */
+static void jit_exit(struct x86 *x, int pc, int count) {
+    if (pc >= 0) {
+        x86_rm(x, X86_16, 0xC7, 0, J_VM, -1, VM_OFF(PC));
+        x86_imm(x, pc, 2);
+    }
+    x86_mov_imm(x, X_RAX, count);
+    *x->p++ = 0xE9;
+    int32_t rel = x->epilogue - (x->p + 4);
+    x86_imm(x, (uint32_t)rel, 4);
+}
+
+/* Call fn(vm, esi, edx) as the instruction ending at next would */
+static void jit_call(struct x86 *x, const void *fn, uint16_t next) {
+    x86_rm(x, X86_16, 0xC7, 0, J_VM, -1, VM_OFF(PC));
+    x86_imm(x, next, 2);
+    x86_rm(x, X86_16, 0x89, J_A, J_VM, -1, VM_OFF(A));
+    jit_spill_carry(x);
+    x86_rr(x, X86_W, 0x89, J_VM, X_RDI);                /* mov rdi, rbx */
+    x86_op(x, X86_W, 0xB8, 0, -1, X_RAX);               /* mov rax, fn */
+    x86_imm(x, (uintptr_t)fn, 8);
+    x86_rr(x, 0, 0xFF, 2, X_RAX);                       /* call rax */
+    jit_load_carry(x);
+}
+
+static void jit_check_stop(struct x86 *x, int count) {
+    x86_rm(x, 0, 0x80, 7, J_VM, -1, VM_OFF(stop));      /* cmp byte [stop], 0 */
+    *x->p++ = 0;
+    uint8_t *skip = x86_jump(x, CC_E);
+    jit_exit(x, -1, count);
+    x86_patch(x, skip);
+}
+
+/* Store al at [A] */
+static void jit_store(struct x86 *x, uint16_t next, int count) {
+    x86_rr(x, 0, 0x89, J_A, X_RCX);                     /* mov ecx, r12d */
+    x86_rr(x, 0, 0xC1, 5, X_RCX);                       /* shr ecx, PAGE_SHIFT */
+    *x->p++ = PAGE_SHIFT;
+    x86_rm(x, 0, 0x80, 7, J_VM, X_RCX, VM_OFF(page_flags));
+    *x->p++ = PAGE_WRITE;
+    uint8_t *slow = x86_jump(x, CC_NE);
+    x86_rm(x, 0, 0x88, X_RAX, J_MEM, J_A, 0);           /* mov [rbp + r12], al */
+    uint8_t *done = x86_jump(x, -1);
+    x86_patch(x, slow);
+    x86_rr(x, 0, 0x0FB6, X_RDX, X_RAX);                 /* movzx edx, al */
+    x86_rr(x, 0, 0x89, J_A, X_RSI);                     /* mov esi, r12d */
+    jit_call(x, (const void *)mem_write_slow, next);
+    jit_check_stop(x, count);
+    x86_patch(x, done);
+}
+
+/* D0 op D1 (and the carry) into al */
+static void jit_alu(struct x86 *x, int alu) {
+    static const unsigned ops[] = { 0, 0x10, 0x18, 0x21, 0x09, 0x31 };
+
+    x86_rr(x, 0, 0x89, J_D0, X_RAX);                    /* mov eax, r14d */
+    if (alu == 1 || alu == 2 || alu == 7 || alu == 8) {
+        x86_rr(x, 0, 0x0FBA, 4, J_C);                   /* bt r11d, 0 */
+        *x->p++ = 0;
+    }
+    if (alu >= 1 && alu <= 5)
+        x86_rr(x, 0, ops[alu], J_D1, X_RAX);            /* adc/sbb/and/or/xor al, r15b */
+    else if (alu == 6)
+        x86_rr(x, 0, 0xF7, 2, X_RAX);                   /* not eax */
+    else if (alu >= 7)
+        x86_rr(x, 0, 0xD0, alu == 7 ? 2 : 3, X_RAX);    /* rcl/rcr al, 1 */
+    if (alu == 1 || alu == 2 || alu == 7 || alu == 8)
+        x86_rr(x, 0, 0x0F92, 0, J_C);                   /* setc r11b */
+}
+
+/* movzx eax, byte [rbp + r12] */
+static void jit_load_at_a(struct x86 *x, int reg) {
+    x86_rm(x, 0, 0x0FB6, reg, J_MEM, J_A, 0);
+}
+
+/* Code for the ROM block b of image, into buf; returns the entry point */
+static uint8_t *jit_emit(uint8_t *buf, const uint8_t *image, const struct block *b, uint8_t **end) {
+    static const int saved[] = { X_RBX, X_RBP, X_R12, X_R13, X_R14, X_R15 };
+    struct x86 x = { buf, buf };
+
+    /* The epilogue comes first, so every exit jumps back to it */
+    x86_rm(&x, X86_16, 0x89, J_A, J_VM, -1, VM_OFF(A));
+    x86_rm(&x, X86_16, 0x89, J_T, J_VM, -1, VM_OFF(T));
+    x86_rm(&x, 0, 0x88, J_D0, J_VM, -1, VM_OFF(D0));
+    x86_rm(&x, 0, 0x88, J_D1, J_VM, -1, VM_OFF(D1));
+    jit_spill_carry(&x);
+    x86_rr(&x, X86_W, 0x83, 0, X_RSP);                  /* add rsp, 8 */
+    *x.p++ = 8;
+    for (int i = 5; i >= 0; i--)
+        x86_push_pop(&x, 0x58, saved[i]);
+    *x.p++ = 0xC3;
+
+    uint8_t *entry = x.p;
+    for (int i = 0; i < 6; i++)
+        x86_push_pop(&x, 0x50, saved[i]);
+    x86_rr(&x, X86_W, 0x83, 5, X_RSP);                  /* sub rsp, 8 */
+    *x.p++ = 8;
+    x86_rr(&x, X86_W, 0x89, X_RDI, J_VM);               /* mov rbx, rdi */
+    x86_rm(&x, X86_W, 0x8B, J_MEM, J_VM, -1, VM_OFF(memory));
+    x86_rm(&x, 0, 0x0FB7, J_A, J_VM, -1, VM_OFF(A));
+    x86_rm(&x, 0, 0x0FB7, J_T, J_VM, -1, VM_OFF(T));
+    x86_rm(&x, 0, 0x0FB6, J_D0, J_VM, -1, VM_OFF(D0));
+    x86_rm(&x, 0, 0x0FB6, J_D1, J_VM, -1, VM_OFF(D1));
+    jit_load_carry(&x);
+
+    uint16_t pc = b->pc;
+    uint8_t last = 0;
+    for (int count = 1; count <= b->insns; count++) {
+        uint8_t op = last = image[pc];
+        uint16_t arg = op_length[op] == 3 ? image[pc + 1] | image[pc + 2] << 8 : image[pc + 1];
+        uint16_t next = pc + op_length[op];
+        uint8_t *skip;
+
+        switch (op) {
+        case 0x00: x86_mov_imm(&x, J_A, arg); break;
+        case 0x01: x86_mov_imm(&x, J_D0, arg); break;
+        case 0x02: x86_mov_imm(&x, J_D1, arg); break;
+        case 0x03: jit_load_at_a(&x, J_D0); break;
+        case 0x04: jit_load_at_a(&x, J_D1); break;
+        case 0x05:
+            jit_load_at_a(&x, X_RAX);
+            x86_rr(&x, 0, 0x81, 4, J_T);                /* and r13d, 0xFF00 */
+            x86_imm(&x, 0xFF00, 4);
+            x86_rr(&x, 0, 0x09, X_RAX, J_T);            /* or r13d, eax */
+            break;
+        case 0x06:
+            jit_load_at_a(&x, X_RAX);
+            x86_rr(&x, 0, 0xC1, 4, X_RAX);              /* shl eax, 8 */
+            *x.p++ = 8;
+            x86_rr(&x, 0, 0x0FB6, J_T, J_T);            /* movzx r13d, r13b */
+            x86_rr(&x, 0, 0x09, X_RAX, J_T);
+            break;
+        case 0x07: x86_rr(&x, 0, 0x89, J_T, J_A); break;
+        case 0x08:
+            x86_rm(&x, X86_16, 0x89, J_T, J_VM, -1, VM_OFF(PC));
+            jit_exit(&x, -1, count);
+            break;
+        case 0x20: jit_exit(&x, arg, count); break;
+        case 0x21:
+        case 0x22:
+            x86_rr(&x, 0, 0x85, J_C, J_C);              /* test r11d, r11d */
+            skip = x86_jump(&x, op == 0x21 ? CC_E : CC_NE);
+            jit_exit(&x, arg, count);
+            x86_patch(&x, skip);
+            jit_exit(&x, next, count);
+            break;
+        case 0x40: x86_rr(&x, 0, 0x31, J_C, J_C); break;
+        case 0x41: x86_mov_imm(&x, J_C, 1); break;
+        case 0xA0:
+            jit_call(&x, (const void *)op_in, next);
+            jit_check_stop(&x, count);
+            break;
+        case 0xA1: jit_call(&x, (const void *)op_putc, next); break;
+        case 0xA2:
+        case 0xA3:
+            jit_load_at_a(&x, X_RAX);
+            x86_rm(&x, 0, 0x88, X_RAX, J_VM, -1, op == 0xA2 ? VM_OFF(cur_x) : VM_OFF(cur_y));
+            break;
+        case 0xA4: jit_call(&x, (const void *)op_cls, next); break;
+        default:
+            if (op >= 0x60 && op <= 0x71) {
+                jit_alu(&x, (op - 0x60) >> 1);
+                if (op & 1)
+                    x86_rr(&x, 0, 0x0FB6, J_D0, X_RAX); /* movzx r14d, al */
+                else
+                    jit_store(&x, next, count);
+                break;
+            }
+#ifdef DUOVM_TRAP_UNDEFINED
+            x86_mov_imm(&x, X_RSI, op);
+            jit_call(&x, (const void *)op_undefined, next);
+            jit_check_stop(&x, count);
+#endif
+            break;
+        }
+        pc = next;
+    }
+    /* Ran into BLOCK_MAX or the end of ROM rather than a jump */
+    if (!ends_block(last))
+        jit_exit(&x, pc, b->insns);
+    *end = x.p;
+    return entry;
+}
+
+/* Compile b, or NULL if the arena is full or can't be mapped */
+static jit_fn jit_compile(const DuoROM *rom, struct block *b) {
+    static _Thread_local uint8_t buf[JIT_MAX];
+    jit_fn fn = NULL;
+    uint8_t *end;
+    uint8_t *entry = jit_emit(buf, rom->image, b, &end);
+    size_t len = end - buf;
+
+    pthread_mutex_lock(&jit_arena.lock);
+    if (!jit_arena.tried) {
+        jit_arena.tried = true;
+        int fd = memfd_create("duovm-jit", MFD_CLOEXEC);
+        if (fd >= 0 && ftruncate(fd, JIT_ARENA) == 0) {
+            void *rw = mmap(NULL, JIT_ARENA, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            void *rx = mmap(NULL, JIT_ARENA, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+            if (rw != MAP_FAILED && rx != MAP_FAILED) {
+                jit_arena.rw = rw;
+                jit_arena.rx = rx;
+            }
+        }
+        if (fd >= 0)
+            close(fd);
+    }
+    if ((fn = atomic_load_explicit(&b->native, memory_order_acquire))) {
+        /* another thread got there first */
+    } else if (jit_arena.rw && jit_arena.used + len <= JIT_ARENA) {
+        memcpy(jit_arena.rw + jit_arena.used, buf, len);
+        fn = (jit_fn)(void *)(jit_arena.rx + jit_arena.used + (entry - buf));
+        jit_arena.used = (jit_arena.used + len + 15) & ~(size_t)15;
+        atomic_store_explicit(&b->native, fn, memory_order_release);
+    }
+    pthread_mutex_unlock(&jit_arena.lock);
+    return fn;
+}
+
+/* exec_block(), or the block's native code once it is hot */
+static long run_block(DuoVM *vm, struct block *b) {
+    jit_fn fn = atomic_load_explicit(&b->native, memory_order_acquire);
+    if (fn)
+        return fn(vm);
+    if (b->pc < SRAM_START && use_jit) {
+        /* Racy on purpose: a lost count only delays compiling */
+        unsigned hits = atomic_load_explicit(&b->hits, memory_order_relaxed) + 1;
+        atomic_store_explicit(&b->hits, hits, memory_order_relaxed);
+        if (hits == JIT_HOT && (fn = jit_compile(vm->rom, b)))
+            return fn(vm);
+    }
+    return exec_block(vm, b);
+}
+
+#else
+#define run_block exec_block
+#endif /* DUOVM_JIT */
+
+/*
+ * Fuzzing coverage for a block entered at its start: all of it if it ran
+ * to the end, otherwise up to where it stopped, counting a 0xA0 parked on.
+ */
+static void cover_block(DuoVM *vm, const struct block *b, bool whole) {
+    uint32_t end = whole ? b->pc + b->bytes : vm->PC + ((vm->stop & STOP_INPUT) != 0);
+    memset(vm->cover + b->pc, 1, end - b->pc);
+}
+
+static long tc_run(DuoVM *vm, long n) {
+    long done = 0;
+    while (done < n && !vm->stop) {
+        uint16_t pc = vm->PC;
+        struct block *b;
+        if (pc < SRAM_START)
+            b = atomic_load_explicit(&vm->rom->blocks[pc], memory_order_acquire);
+        else
+            b = vm->sram_blocks ? vm->sram_blocks[pc - SRAM_START] : NULL;
+        if (!b && !(b = translate(vm, pc))) {
+            /* Instruction straddles the ROM/SRAM boundary or wraps */
+            if (vm->cover)
+                vm->cover[pc] = 1;
+            done += interp_run(vm, 1);
+            continue;
+        }
+
+        if (b->insns > n - done) {
+            /* The budget ends inside b: finish exactly, uncached */
+            done += interp_run(vm, n - done);
+            if (vm->cover)
+                cover_block(vm, b, false);
+            continue;
+        }
+
+        vm->cur_block = b;
+        long k = run_block(vm, b);
+        done += k;
+        vm->cycles += b->cycles[k];
+        vm->cur_block = NULL;
+        if (vm->cover)
+            cover_block(vm, b, k == b->insns);
+        if (b->stale)
+            free(b);
+    }
+    return done;
+}
+
+/*
+ * Execute up to n instructions, stopping early while parked on input or
+ * after a trap.
+ * Returns the number of instructions executed.
+ */
+static long run(DuoVM *vm, long n) {
+    if ((vm->stop & STOP_INPUT) && !resume_input(vm))
+        return 0;
+#ifdef DUOVM_AOT
+    if (use_aot && vm->rom->aot)
+        return aot_run(vm, n);
+#endif
+    return use_tc ? tc_run(vm, n) : interp_run(vm, n);
+}
+
+/* Fill the decode tables; call once before any machine runs */
+static void init_cpu(void) {
+    for (int i = 0; i < 256; i++) {
+        op_length[i] = 1;
+        op_cycles[i] = UNDEFINED_CYCLES;
+    }
+#define X(code, name, len, cyc, text) op_length[code] = len; op_cycles[code] = cyc;
+    DUO_OPCODES(X)
+#undef X
+
+#ifndef DUOVM_THREADED
+    for (int i = 0; i < 256; i++) {
+        dispatch[i] = exec_undefined;
+        pre_dispatch[i] = pre_undefined;
+        uop_dispatch[i] = uop_undefined;
+    }
+#define X(code, name, len, cyc, text) \
+    dispatch[code] = exec_##name; pre_dispatch[code] = pre_##name; uop_dispatch[code] = op_##name;
+    DUO_OPCODES(X)
+#undef X
+#endif
+}
+
+/* ================= Machines ================= */
+
+static uint32_t fnv1a(const uint8_t *p, size_t n);
+
+/*
+ * Wrap a loaded image (MEM_SIZE bytes) for sharing.  On Linux the image is
+ * also put in a memfd that machines map privately; elsewhere each machine
+ * falls back to a full copy.
+ */
+static DuoROM *rom_new(const uint8_t *image, uint16_t entry) {
+    DuoROM *rom = xcalloc(1, sizeof(*rom));
+    memcpy(rom->image, image, MEM_SIZE);
+    rom->entry = entry;
+
+    /* Needs op_length[], so init_cpu() must have run */
+    rom->code = xcalloc(SRAM_START, sizeof(*rom->code));
+    for (uint32_t pc = 0; pc < SRAM_START; pc++) {
+        uint8_t op = image[pc];
+        unsigned len = op_length[op];
+        if (pc + len > SRAM_START)
+            continue;
+        rom->code[pc].op = op;
+        rom->code[pc].len = len;
+        rom->code[pc].arg = len == 3 ? image[pc + 1] | image[pc + 2] << 8 :
+                            len == 2 ? image[pc + 1] : op;
+    }
+
+    rom->rom_hash = fnv1a(image, SRAM_START);
+#ifdef DUOVM_AOT
+    rom->aot = rom->rom_hash == aot_rom_hash;
+#endif
+    rom->fd = -1;
+#ifdef __linux__
+    int fd = memfd_create("duovm-rom", MFD_CLOEXEC);
+    if (fd >= 0 && write(fd, image, MEM_SIZE) == MEM_SIZE)
+        rom->fd = fd;
+    else if (fd >= 0)
+        close(fd);
+#endif
+    return rom;
+}
+
+/* A fresh machine booting rom at its entry PC */
+static DuoVM *vm_new(DuoROM *rom) {
+    DuoVM *vm = xcalloc(1, sizeof(*vm));
+    void *mem = MAP_FAILED;
+
+    if (rom->fd >= 0)
+        mem = mmap(NULL, MEM_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, rom->fd, 0);
+    if (mem == MAP_FAILED) {
+        mem = mmap(NULL, MEM_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            shutdown_display();
+            perror("mmap");
+            exit(1);
+        }
+        memcpy(mem, rom->image, MEM_SIZE);
+    }
+    /* mem_write() never stores below SRAM_START; let the MMU enforce it too */
+    if (SRAM_START % sysconf(_SC_PAGESIZE) == 0)
+        mprotect(mem, SRAM_START, PROT_READ);
+
+    vm->rom = rom;
+    vm->code = rom->code;
+    vm->memory = mem;
+    init_memory_map(vm);
+    vm->PC = rom->entry;
+    vm->running = true;
+    vm->born = now_sec();
+    vm->metrics_seen = atomic_load_explicit(&metrics_asked, memory_order_relaxed);
+    clear_screen_vm(vm);
+#ifdef DUOVM_PROFILE
+    vm->prof = prof_new();
+    vm->prof->expect = vm->PC;
+#endif
+#ifdef DUOVM_MEM_STATS
+    vm->mstats = xcalloc(1, sizeof(*vm->mstats));
+    vm->mstats->machines = 1;
+#endif
+    return vm;
+}
+
+static void rom_free(DuoROM *rom) {
+    for (int i = 0; i < SRAM_START; i++)
+        free(atomic_load_explicit(&rom->blocks[i], memory_order_relaxed));
+    if (rom->fd >= 0)
+        close(rom->fd);
+    free(rom->code);
+    free(rom);
+}
+
+static void vm_free(DuoVM *vm) {
+    if (vm->sram_blocks) {
+        for (int i = 0; i < MEM_SIZE - SRAM_START; i++)
+            free(vm->sram_blocks[i]);
+        free(vm->sram_blocks);
+    }
+    munmap(vm->memory, MEM_SIZE);
+#ifdef DUOVM_PROFILE
+    prof_free(vm->prof);
+#endif
+#ifdef DUOVM_MEM_STATS
+    free(vm->mstats);
+#endif
+    free(vm);
+}
+
+/*
+ * Speed limit for run_machine(), in instructions per second of host time
+ * spent running (time waiting for input doesn't count); 0 runs flat out.
+ */
+static long long pace_rate = 0;
+
+/* Sleep until `done` instructions after epoch are due at pace_rate */
+static void pace(const struct timespec *epoch, long long done) {
+    struct timespec due = *epoch;
+    due.tv_sec += done / pace_rate;
+    due.tv_nsec += (done % pace_rate) * 1000000000LL / pace_rate;
+    if (due.tv_nsec >= 1000000000L) {
+        due.tv_sec++;
+        due.tv_nsec -= 1000000000L;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) > 0)
+        ;
+}
+
+/*
+ * Idle loops.  Only 0xA0 lets anything from outside reach a machine, so
+ * code that neither stores, reads input nor touches the display works on
+ * the registers alone, against memory that can't change under it.  If
+ * the registers ever come back to a state they were in, the machine will
+ * go round that cycle forever: it is halted.  idle_loop() runs such code
+ * ahead on a scratch copy of the registers with Brent's cycle finding,
+ * which catches a jump to itself as well as loops that take a few passes
+ * to settle (reloading A, clearing the carry), as long as warm-up plus
+ * period fit in PROBE_MAX instructions.
+ */
+#define PROBE_MAX 256
+
+/* Opcodes with no effect outside the registers */
+#define OP_PURE(code) ((code) < 0xA0 && !((code) >= 0x60 && !((code) & 1)))
+
+/* Execute one instruction if it is pure; false if it isn't */
+static bool probe_step(DuoVM *vm) {
+    switch (fetch(vm, vm->PC)) {
+#define X(code, name, len, cyc, text) \
+        case code: if (!OP_PURE(code)) return false; EXEC(name, len); return true;
+        DUO_OPCODES(X)
+#undef X
+    }
+#ifdef DUOVM_TRAP_UNDEFINED
+    return false;
+#else
+    vm->PC++;
+    return true;
+#endif
+}
+
+struct regs {
+    uint16_t PC, A, T;
+    uint8_t  D0, D1;
+    bool     C;
+};
+
+static void get_regs(struct regs *r, const DuoVM *vm) {
+    *r = (struct regs){ vm->PC, vm->A, vm->T, vm->D0, vm->D1, carry(vm) };
+}
+
+static bool same_regs(const struct regs *r, const DuoVM *vm) {
+    return r->PC == vm->PC && r->A == vm->A && r->T == vm->T &&
+           r->D0 == vm->D0 && r->D1 == vm->D1 && r->C == carry(vm);
+}
+
+static bool idle_loop(DuoVM *vm) {
+    DuoVM probe;
+    struct regs saved;
+    int power = 1, lam = 0;
+
+    get_regs(&saved, vm);
+    probe.PC = vm->PC;
+    probe.A = vm->A;
+    probe.T = vm->T;
+    probe.D0 = vm->D0;
+    probe.D1 = vm->D1;
+    probe.C = vm->C;
+    probe.memory = vm->memory;
+#ifdef DUOVM_MEM_STATS
+    probe.mstats = NULL;
+#endif
+    for (int i = 0; i < PROBE_MAX; i++) {
+        if (!probe_step(&probe))
+            return false;
+        if (same_regs(&saved, &probe))
+            return true;
+        if (++lam == power) {
+            get_regs(&saved, &probe);
+            power *= 2;
+            lam = 0;
+        }
+    }
+    return false;
+}
+
+/*
+ * Run until the machine runs out of input or halts (or, with max_steps,
+ * after that many instructions, or at a debugger break or watchpoint),
+ * feeding it from wait_input() whenever it parks.  Returns the number of
+ * instructions executed.
+ */
+#define RUN_BURST 20000     /* instructions between idle loop checks */
+
+#ifdef DUOVM_MEM_STATS
+static void heat_serve(DuoVM *const *live, int n);
+#endif
+
+static long long run_machine(DuoVM *vm, long long max_steps) {
+    long long executed = 0, pace_base = 0;
+    long chunk = RUN_BURST;
+    struct timespec epoch;
+
+    /* Paced machines run in slices of about a millisecond */
+    if (pace_rate && pace_rate / 1000 < chunk)
+        chunk = pace_rate >= 1000 ? pace_rate / 1000 : 1;
+    clock_gettime(CLOCK_MONOTONIC, &epoch);
+
+    while (vm->running) {
+        long burst = chunk;
+        if (max_steps && max_steps - executed < burst)
+            burst = max_steps - executed;
+        double t0 = now_sec();
+        long n = run(vm, burst);
+        vm->run_time += now_sec() - t0;
+        executed += n;
+        vm->icount += n;
+        vm->executed += n;
+        if (pace_rate)
+            pace(&epoch, executed - pace_base);
+        if (display->flush)
+            flush_screen_paced(vm);
+#ifdef DUOVM_MEM_STATS
+        heat_serve(&vm, 1);
+#endif
+        if (metrics_due(vm))
+            metrics_line(stderr, "machine", vm, 0);
+        if ((max_steps && executed >= max_steps) || (vm->stop & (STOP_BREAK | STOP_WATCH)))
+            break;
+        if (vm->stop & STOP_INPUT) {
+            double t1 = now_sec();
+            if (!wait_input(vm))
+                vm->running = false;
+            vm->wait_time += now_sec() - t1;
+            clock_gettime(CLOCK_MONOTONIC, &epoch);
+            pace_base = executed;
+        } else if (idle_loop(vm)) {
+            vm->running = false;
+            vm->halted = true;
+        }
+    }
+    return executed;
+}
+
+/* ================= Loader ================= */
+
+/* Lowest and one-past-highest address written by the last load */
+static uint32_t load_lo, load_hi;
+
+/* Map a whole file read-only; returns NULL with *len = 0 for an empty one */
+static const uint8_t *map_file(const char *path, size_t *len) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        exit(1);
+    }
+    *len = st.st_size;
+    if (!*len) {
+        close(fd);
+        return NULL;
+    }
+
+    const uint8_t *p = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        perror(path);
+        exit(1);
+    }
+    return p;
+}
+
+static void unmap_file(const uint8_t *p, size_t len) {
+    if (p)
+        munmap((void *)p, len);
+}
+
+/* The original fgets/sscanf loader, kept as the reference for -b */
+static void load_hex_legacy(const char *path, uint8_t *memory) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror("open");
+        exit(1);
+    }
+
+    load_lo = MEM_SIZE;
+    load_hi = 0;
+
+    char line[512];
+    while (fgets(line, sizeof(line), f)) {
+        if (!isxdigit(line[0])) continue;
+
+        uint16_t addr;
+        sscanf(line, "%hx:", &addr);
+
+        char *p = strchr(line, ':') + 1;
+        while (*p) {
+            while (*p == ' ') p++;
+            if (!isxdigit(p[0])) break;
+
+            unsigned v;
+            sscanf(p, "%02x", &v);
+            if (addr < load_lo) load_lo = addr;
+            if (addr + 1u > load_hi) load_hi = addr + 1u;
+            memory[addr++] = v;
+            p += 2;
+        }
+    }
+    fclose(f);
+}
+
+static int hex_digit(int c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+/*
+ * Decode eight " HH" fields (24 characters) at p into out.  Returns false
+ * unless every field is exactly a space and two hex digits; the scalar
+ * path in load_hex() then takes over and pinpoints any error.
+ */
+#define HEX_GROUP  8
+#define HEX_GROUP_CHARS (HEX_GROUP * 3)
+
+#if defined(DUOVM_SSE2)
+
+/* Per-lane nibble value; *ok gets 0xFF in lanes holding a hex digit */
+static inline __m128i hex_nibbles(__m128i c, __m128i *ok) {
+    __m128i digit = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+    __m128i alpha = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+    __m128i is_digit = _mm_cmpeq_epi8(_mm_min_epu8(digit, _mm_set1_epi8(9)), digit);
+    __m128i is_alpha = _mm_cmpeq_epi8(_mm_min_epu8(alpha, _mm_set1_epi8(5)), alpha);
+    *ok = _mm_or_si128(is_digit, is_alpha);
+    return _mm_or_si128(_mm_and_si128(is_digit, digit),
+                        _mm_andnot_si128(is_digit, _mm_add_epi8(alpha, _mm_set1_epi8(10))));
+}
+
+/* Lane k holds (nibble[k] << 4) | nibble[k + 1] */
+static inline __m128i hex_pairs(__m128i n) {
+    __m128i hi = _mm_and_si128(_mm_slli_epi16(n, 4), _mm_set1_epi8((char)0xF0));
+    return _mm_or_si128(hi, _mm_srli_si128(n, 1));
+}
+
+static bool hex_decode8(const char *p, uint8_t *out) {
+    /* Characters 0-15 and 8-23; spaces sit where the index is a multiple of 3 */
+    __m128i c0 = _mm_loadu_si128((const __m128i *)p);
+    __m128i c1 = _mm_loadu_si128((const __m128i *)(p + 8));
+    __m128i sp = _mm_set1_epi8(' ');
+    __m128i ok0, ok1;
+    __m128i n0 = hex_nibbles(c0, &ok0);
+    __m128i n1 = hex_nibbles(c1, &ok1);
+
+    if (_mm_movemask_epi8(ok0) != 0x6DB6 ||
+        _mm_movemask_epi8(_mm_cmpeq_epi8(c0, sp)) != 0x9249 ||
+        _mm_movemask_epi8(ok1) != 0xDB6D ||
+        _mm_movemask_epi8(_mm_cmpeq_epi8(c1, sp)) != 0x2492)
+        return false;
+
+    uint8_t b0[16], b1[16];
+    _mm_storeu_si128((__m128i *)b0, hex_pairs(n0));
+    _mm_storeu_si128((__m128i *)b1, hex_pairs(n1));
+    out[0] = b0[1];  out[1] = b0[4];  out[2] = b0[7];  out[3] = b0[10];
+    out[4] = b0[13]; out[5] = b1[8];  out[6] = b1[11]; out[7] = b1[14];
+    return true;
+}
+
+#elif defined(DUOVM_NEON)
+
+static inline uint8x16_t hex_nibbles(uint8x16_t c, uint8x16_t *ok) {
+    uint8x16_t digit = vsubq_u8(c, vdupq_n_u8('0'));
+    uint8x16_t alpha = vsubq_u8(vorrq_u8(c, vdupq_n_u8(0x20)), vdupq_n_u8('a'));
+    uint8x16_t is_digit = vcleq_u8(digit, vdupq_n_u8(9));
+    uint8x16_t is_alpha = vcleq_u8(alpha, vdupq_n_u8(5));
+    *ok = vorrq_u8(is_digit, is_alpha);
+    return vbslq_u8(is_digit, digit, vaddq_u8(alpha, vdupq_n_u8(10)));
+}
+
+/* 0xFF where a " HH" field has a digit, 0 where it has the space */
+static const uint8_t hex_lanes[HEX_GROUP_CHARS] = {
+    0, 0xFF, 0xFF, 0, 0xFF, 0xFF, 0, 0xFF, 0xFF, 0, 0xFF, 0xFF,
+    0, 0xFF, 0xFF, 0, 0xFF, 0xFF, 0, 0xFF, 0xFF, 0, 0xFF, 0xFF,
+};
+
+static bool hex_decode8(const char *p, uint8_t *out) {
+    uint8x16_t c0 = vld1q_u8((const uint8_t *)p);
+    uint8x16_t c1 = vld1q_u8((const uint8_t *)p + 8);
+    uint8x16_t want0 = vld1q_u8(hex_lanes);
+    uint8x16_t want1 = vld1q_u8(hex_lanes + 8);
+    uint8x16_t sp = vdupq_n_u8(' ');
+    uint8x16_t ok0, ok1;
+    uint8x16_t n0 = hex_nibbles(c0, &ok0);
+    uint8x16_t n1 = hex_nibbles(c1, &ok1);
+
+    uint8x16_t good0 = vandq_u8(vceqq_u8(ok0, want0), vceqq_u8(vceqq_u8(c0, sp), vmvnq_u8(want0)));
+    uint8x16_t good1 = vandq_u8(vceqq_u8(ok1, want1), vceqq_u8(vceqq_u8(c1, sp), vmvnq_u8(want1)));
+    if (vminvq_u8(vandq_u8(good0, good1)) != 0xFF)
+        return false;
+
+    uint8_t nib[HEX_GROUP_CHARS];
+    vst1q_u8(nib, n0);
+    vst1q_u8(nib + 8, n1);
+    for (int i = 0; i < HEX_GROUP; i++)
+        out[i] = (nib[3 * i + 1] << 4) | nib[3 * i + 2];
+    return true;
+}
+
+#else
+
+static bool hex_decode8(const char *p, uint8_t *out) {
+    for (int i = 0; i < HEX_GROUP; i++, p += 3) {
+        int hi = hex_digit(p[1]), lo = hex_digit(p[2]);
+        if (p[0] != ' ' || hi < 0 || lo < 0)
+            return false;
+        out[i] = (hi << 4) | lo;
+    }
+    return true;
+}
+
+#endif
+
+/* Store n decoded bytes at addr, wrapping at 0xFFFF like the old loader */
+static void hex_store(uint8_t *memory, uint16_t addr, const uint8_t *v, int n) {
+    if (addr + (uint32_t)n <= MEM_SIZE) {
+        memcpy(memory + addr, v, n);
+        if (addr < load_lo) load_lo = addr;
+        if (addr + (uint32_t)n > load_hi) load_hi = addr + n;
+        return;
+    }
+    for (int i = 0; i < n; i++, addr++) {
+        if (addr < load_lo) load_lo = addr;
+        if (addr + 1u > load_hi) load_hi = addr + 1u;
+        memory[addr] = v[i];
+    }
+}
+
+static void hex_error(const char *path, int line, long col, const char *why) {
+    fprintf(stderr, "%s:%d:%ld: %s\n", path, line, col, why);
+    exit(1);
+}
+
+/*
+ * Load an `AAAA: BB BB ...` file.  Blank lines and lines starting with
+ * '#' or ';' are skipped; anything else that isn't a well-formed record
+ * is reported with its line and column.
+ */
+static void load_hex(const char *path, uint8_t *memory) {
+    size_t len;
+    const uint8_t *map = map_file(path, &len);
+    const char *text = (const char *)map;
+    const char *end = text + len;
+    int lineno = 0;
+
+    load_lo = MEM_SIZE;
+    load_hi = 0;
+
+    for (const char *line = text; line < end; ) {
+        const char *eol = memchr(line, '\n', end - line);
+        const char *next = eol ? eol + 1 : end;
+        const char *stop = eol ? eol : end;
+        const char *p = line;
+        lineno++;
+
+        while (stop > p && (stop[-1] == '\r' || stop[-1] == ' ' || stop[-1] == '\t'))
+            stop--;
+        if (p == stop || *p == '#' || *p == ';') {
+            line = next;
+            continue;
+        }
+
+        uint32_t addr = 0;
+        int digits = 0;
+        for (; p < stop && hex_digit(*p) >= 0; p++, digits++)
+            addr = (addr << 4) | hex_digit(*p);
+        if (digits == 0 || digits > 4)
+            hex_error(path, lineno, 1, "expected a 1-4 digit hex address");
+        if (p == stop || *p != ':')
+            hex_error(path, lineno, p - line + 1, "expected ':' after the address");
+        p++;
+
+        uint16_t a = addr;
+        uint8_t group[HEX_GROUP];
+        while (p < stop) {
+            if (stop - p >= HEX_GROUP_CHARS && hex_decode8(p, group)) {
+                hex_store(memory, a, group, HEX_GROUP);
+                a += HEX_GROUP;
+                p += HEX_GROUP_CHARS;
+                continue;
+            }
+            if (*p == ' ' || *p == '\t') {
+                p++;
+                continue;
+            }
+
+            int hi = hex_digit(p[0]);
+            int lo = p + 1 < stop ? hex_digit(p[1]) : -1;
+            if (hi < 0)
+                hex_error(path, lineno, p - line + 1, "expected a hex byte");
+            if (lo < 0)
+                hex_error(path, lineno, p - line + 1, "hex byte needs two digits");
+            group[0] = (hi << 4) | lo;
+            hex_store(memory, a++, group, 1);
+            p += 2;
+        }
+        line = next;
+    }
+    unmap_file(map, len);
+}
+
+/*
+ * Binary image: a 20-byte little-endian header followed by `length` bytes
+ * that are copied to memory[load .. load + length).
+ *
+ *   0  "DUOI"      magic
+ *   4  u16         version (1)
+ *   6  u16         load address
+ *   8  u32         length (at most MEM_SIZE - load)
+ *  12  u16         entry PC
+ *  14  u16         reserved, 0
+ *  16  u32         FNV-1a checksum of the payload
+ */
+#define IMAGE_MAGIC   "DUOI"
+#define IMAGE_VERSION 1
+#define IMAGE_HEADER  20
+
+static uint32_t fnv1a(const uint8_t *p, size_t n) {
+    uint32_t h = 2166136261u;
+    while (n--) {
+        h ^= *p++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static uint16_t get16(const uint8_t *p) { return p[0] | (p[1] << 8); }
+static uint32_t get32(const uint8_t *p) { return get16(p) | ((uint32_t)get16(p + 2) << 16); }
+static void put16(uint8_t *p, uint16_t v) { p[0] = v; p[1] = v >> 8; }
+static void put32(uint8_t *p, uint32_t v) { put16(p, v); put16(p + 2, v >> 16); }
+
+static bool is_image(const char *path) {
+    char magic[4];
+    FILE *f = fopen(path, "rb");
+    bool yes = f && fread(magic, 1, 4, f) == 4 && !memcmp(magic, IMAGE_MAGIC, 4);
+    if (f)
+        fclose(f);
+    return yes;
+}
+
+static void image_error(const char *path, const char *why) {
+    fprintf(stderr, "%s: %s\n", path, why);
+    exit(1);
+}
+
+/* Map an image and copy it into memory[]; returns the entry PC */
+static uint16_t load_image(const char *path, uint8_t *memory) {
+    size_t size;
+    const uint8_t *img = map_file(path, &size);
+    if (size < IMAGE_HEADER)
+        image_error(path, "truncated image header");
+
+    uint16_t load = get16(img + 6);
+    uint32_t length = get32(img + 8);
+    if (memcmp(img, IMAGE_MAGIC, 4) || get16(img + 4) != IMAGE_VERSION)
+        image_error(path, "not a version 1 DUOI image");
+    if (length > (uint32_t)(MEM_SIZE - load) || size - IMAGE_HEADER < length)
+        image_error(path, "payload length out of range");
+    if (fnv1a(img + IMAGE_HEADER, length) != get32(img + 16))
+        image_error(path, "checksum mismatch");
+
+    memcpy(memory + load, img + IMAGE_HEADER, length);
+    load_lo = load;
+    load_hi = load + length;
+    uint16_t entry = get16(img + 12);
+    unmap_file(img, size);
+    return entry;
+}
+
+/* Write memory[load_lo .. load_hi) as an image */
+static void save_image(const char *path, const uint8_t *memory, uint16_t entry) {
+    uint8_t hdr[IMAGE_HEADER] = IMAGE_MAGIC;
+    uint32_t length = load_hi > load_lo ? load_hi - load_lo : 0;
+    uint16_t load = length ? load_lo : 0;
+
+    put16(hdr + 4, IMAGE_VERSION);
+    put16(hdr + 6, load);
+    put32(hdr + 8, length);
+    put16(hdr + 12, entry);
+    put32(hdr + 16, fnv1a(memory + load, length));
+
+    FILE *f = fopen(path, "wb");
+    if (!f || fwrite(hdr, 1, sizeof(hdr), f) != sizeof(hdr) ||
+        fwrite(memory + load, 1, length, f) != length || fclose(f)) {
+        perror(path);
+        exit(1);
+    }
+}
+
+/* Load either format into memory[], picked by magic; returns the entry PC */
+static uint16_t load_program(const char *path, uint8_t *memory) {
+    if (is_image(path))
+        return load_image(path, memory);
+    load_hex(path, memory);
+    return 0;
+}
+
+/* ================= Snapshots ================= */
+
+/*
+ * A snapshot holds everything a program can observe about its machine:
+ * registers, carry, cursor, framebuffer and SRAM.  ROM never changes, so
+ * only the SRAM bytes that differ from the boot image are kept, as runs,
+ * and the ROM hash keeps a snapshot from being restored onto another
+ * program.  Little-endian throughout:
+ *
+ *    0  4  magic "DUOS"
+ *    4  2  version (1)
+ *    6  2  number of SRAM runs
+ *    8  4  ROM hash (FNV-1a of 0000-DFFF)
+ *   12  6  PC, A, T
+ *   18  5  D0, D1, C, cursor x, cursor y
+ *   23  1  reserved, 0
+ *   24  8  instructions executed
+ *   32     framebuffer, SCREEN_H rows of SCREEN_W bytes
+ *          runs: offset from SRAM_START (2), length (2), bytes
+ */
+#define SNAP_MAGIC   "DUOS"
+#define SNAP_VERSION 1
+#define SNAP_HEADER  32
+#define SNAP_FIXED   (SNAP_HEADER + SCREEN_H * SCREEN_W)
+#define SNAP_GAP     4          /* equal bytes a run may span before it ends */
+
+/* Serialize vm into a malloc'd blob; returns its length */
+static size_t vm_snapshot(const DuoVM *vm, uint8_t **out) {
+    const uint8_t *boot = vm->rom->image, *mem = vm->memory;
+    /* Each run has at least one byte, so bytes plus run headers fit in 5x */
+    uint8_t *blob = xcalloc(1, SNAP_FIXED + 5 * (MEM_SIZE - SRAM_START));
+    uint8_t *p = blob + SNAP_FIXED;
+    int runs = 0;
+
+    for (uint32_t a = SRAM_START; a < MEM_SIZE; a++) {
+        if (mem[a] == boot[a])
+            continue;
+        uint32_t start = a, last = a;
+        while (++a < MEM_SIZE && a - last <= SNAP_GAP) {
+            if (mem[a] != boot[a])
+                last = a;
+        }
+        put16(p, start - SRAM_START);
+        put16(p + 2, last + 1 - start);
+        memcpy(p + 4, mem + start, last + 1 - start);
+        p += 4 + last + 1 - start;
+        runs++;
+        a = last;
+    }
+
+    memcpy(blob, SNAP_MAGIC, 4);
+    put16(blob + 4, SNAP_VERSION);
+    put16(blob + 6, runs);
+    put32(blob + 8, vm->rom->rom_hash);
+    put16(blob + 12, vm->PC);
+    put16(blob + 14, vm->A);
+    put16(blob + 16, vm->T);
+    blob[18] = vm->D0;
+    blob[19] = vm->D1;
+    blob[20] = carry(vm);
+    /* Any cursor is fine: 0xA2/0xA3 can park it off screen, and putc clips */
+    blob[21] = vm->cur_x;
+    blob[22] = vm->cur_y;
+    /* A parked 0xA0 runs again after a restore, and is counted again then */
+    uint64_t icount = vm->icount - ((vm->stop & STOP_INPUT) != 0);
+    put32(blob + 24, (uint32_t)icount);
+    put32(blob + 28, (uint32_t)(icount >> 32));
+    memcpy(blob + SNAP_HEADER, vm->screen, sizeof(vm->screen));
+
+    size_t len = p - blob;
+    uint8_t *shrunk = realloc(blob, len);
+    *out = shrunk ? shrunk : blob;
+    return len;
+}
+
+/*
+ * Put vm back in the state blob was taken in.  Returns false, leaving vm
+ * alone, when blob is malformed or comes from another program.  A machine
+ * that was parked on 0xA0 resumes by reading its next key.  Queued keys
+ * and any trap are dropped, so a used machine can be rewound too.
+ */
+static bool vm_restore(DuoVM *vm, const uint8_t *blob, size_t len) {
+    uint8_t sram[MEM_SIZE - SRAM_START];
+
+    if (len < SNAP_FIXED || memcmp(blob, SNAP_MAGIC, 4) ||
+        get16(blob + 4) != SNAP_VERSION || get32(blob + 8) != vm->rom->rom_hash)
+        return false;
+
+    memcpy(sram, vm->rom->image + SRAM_START, sizeof(sram));
+    const uint8_t *p = blob + SNAP_FIXED, *end = blob + len;
+    for (int runs = get16(blob + 6); runs > 0; runs--) {
+        if (end - p < 4)
+            return false;
+        uint32_t off = get16(p), n = get16(p + 2);
+        if (off + n > sizeof(sram) || (size_t)(end - p - 4) < n)
+            return false;
+        memcpy(sram + off, p + 4, n);
+        p += 4 + n;
+    }
+    if (p != end)
+        return false;
+
+    /* Only write the pages that change, so untouched ones stay shared */
+    for (uint32_t a = SRAM_START; a < MEM_SIZE; a += 256) {
+        const uint8_t *src = sram + (a - SRAM_START);
+        if (!memcmp(vm->memory + a, src, 256))
+            continue;
+        for (uint32_t i = 0; i < 256; i++) {
+            if ((vm->page_flags[(a + i) >> PAGE_SHIFT] & PAGE_CODE) && vm->memory[a + i] != src[i])
+                invalidate_code(vm, a + i);
+        }
+        memcpy(vm->memory + a, src, 256);
+    }
+
+    vm->PC = get16(blob + 12);
+    vm->A = get16(blob + 14);
+    vm->T = get16(blob + 16);
+    vm->D0 = blob[18];
+    vm->D1 = blob[19];
+    set_carry(vm, blob[20] != 0);
+    vm->cur_x = blob[21];
+    vm->cur_y = blob[22];
+    vm->icount = get32(blob + 24) | (uint64_t)get32(blob + 28) << 32;
+    memcpy(vm->screen, blob + SNAP_HEADER, sizeof(vm->screen));
+    for (int y = 0; y < SCREEN_H; y++)
+        vm->dirty[y] = (1ULL << SCREEN_W) - 1;
+    vm->running = true;
+    vm->halted = false;
+    vm->stop = 0;
+    vm->trap = TRAP_NONE;
+    vm->keyq_head = vm->keyq_tail;
+    return true;
+}
+
+static void save_snapshot(const DuoVM *vm, const char *path) {
+    uint8_t *blob;
+    size_t len = vm_snapshot(vm, &blob);
+
+    FILE *f = fopen(path, "wb");
+    if (!f || fwrite(blob, 1, len, f) != len || fclose(f)) {
+        perror(path);
+        exit(1);
+    }
+    free(blob);
+}
+
+/* ================= Execution trace decoder ================= */
+
+/* -X: print a -x trace to stdout, one instruction per line */
+static void decode_xtrace(const char *path) {
+    size_t len;
+    const uint8_t *map = map_file(path, &len);
+    struct xtrace_entry e = {0};
+    uint64_t n = 0;
+
+    if (len < XTRACE_HEADER || memcmp(map, XTRACE_MAGIC, 4) || get16(map + 4) != XTRACE_VERSION)
+        image_error(path, "not an execution trace");
+    printf("# ROM %08X; registers are as each instruction found them\n", get32(map + 8));
+
+    const uint8_t *p = map + XTRACE_HEADER, *end = map + len;
+    while (p < end) {
+        uint8_t flags = p[0];
+        size_t need = 2 + (flags & 0x03 ? 0 : 2) + (flags & 0x04 ? 2 : 0) + (flags & 0x08 ? 2 : 0) +
+                      !!(flags & 0x10) + !!(flags & 0x20) + !!(flags & 0x80);
+        if ((size_t)(end - p) < need)
+            image_error(path, "trace is truncated");
+        e.op = p[1];
+        p += 2;
+        if (flags & 0x03) {
+            e.pc += flags & 0x03;
+        } else {
+            e.pc = get16(p);
+            p += 2;
+        }
+        if (flags & 0x04) {
+            e.a = get16(p);
+            p += 2;
+        }
+        if (flags & 0x08) {
+            e.t = get16(p);
+            p += 2;
+        }
+        if (flags & 0x10)
+            e.d0 = *p++;
+        if (flags & 0x20)
+            e.d1 = *p++;
+        if (flags & 0x40)
+            e.c = !e.c;
+
+        printf("%10llu  %04X  %02X %-9s A=%04X T=%04X D0=%02X D1=%02X C=%d",
+               (unsigned long long)n++, e.pc, e.op, op_name(e.op), e.a, e.t, e.d0, e.d1, e.c);
+        if (flags & 0x80)
+            printf("  [%04X]=%02X", e.a, *p++);
+        putchar('\n');
+    }
+    unmap_file(map, len);
+}
+
+/* ================= Control flow ================= */
+
+/*
+ * A static control-flow graph of the ROM, for the disassembler and the
+ * fuzzer's coverage report.  From the entry point it follows fall-through
+ * and the targets of 0x20/0x21/0x22.  0x08 jumps to T, which the program
+ * builds at run time, so those jumps are indirect.  program.hex returns
+ * from every subroutine through one: the caller stores the return address
+ * into two SRAM bytes before it jumps, and the subroutine loads T from
+ * them.  So every block is run over the values of A, D0 and T that its
+ * own immediates give, and an indirect jump whose T came from two fixed
+ * addresses goes back to every block that stores its own end address
+ * there.  New code can store new return addresses, so this repeats until
+ * nothing new turns up.  A store through a computed A can still hide a target, so
+ * bytes the graph misses aren't proven dead.
+ */
+#define CFG_INSN    0x01        /* an instruction starts here */
+#define CFG_LEADER  0x02        /* and so does a block */
+#define CFG_OPERAND 0x04        /* operand byte of an instruction */
+#define CFG_VIA_T   0x08        /* leader reached by an indirect jump */
+
+struct cfg_block {
+    uint16_t pc, end;           /* [pc, end) */
+    uint16_t succ[2];           /* jump target, then fall-through */
+    int      nsucc;
+    bool     indirect;          /* ends in jmp T */
+    int      t_src[2];          /* where it loaded T's low and high byte, or -1 */
+};
+
+/* A constant some block stores, kept to resolve the indirect jumps */
+struct cfg_store {
+    uint16_t block, addr;
+    uint8_t  value;
+};
+
+/* An indirect jump, by the block it ends, and one place it goes */
+struct cfg_edge {
+    uint16_t from, to;
+};
+
+struct cfg {
+    uint8_t flags[SRAM_START];
+    struct cfg_block *blocks;
+    size_t nblocks;
+    struct cfg_edge *edges;
+    size_t nedges;
+    size_t code_bytes;
+    uint16_t *work;             /* leaders not yet followed */
+    size_t nwork;
+};
+
+static void cfg_leader(struct cfg *g, uint32_t pc) {
+    if (pc < SRAM_START && !(g->flags[pc] & CFG_LEADER)) {
+        g->flags[pc] |= CFG_LEADER;
+        g->work[g->nwork++] = pc;
+    }
+}
+
+/* Mark the instructions from pc up to where control leaves the straight line */
+static void cfg_follow(struct cfg *g, const uint8_t *image, uint32_t pc) {
+    while (pc < SRAM_START && !(g->flags[pc] & CFG_INSN)) {
+        uint8_t op = image[pc];
+        unsigned len = op_length[op];
+        if (pc + len > SRAM_START)
+            break;
+        g->flags[pc] |= CFG_INSN;
+        for (unsigned i = 1; i < len; i++)
+            g->flags[pc + i] |= CFG_OPERAND;
+        if (op >= 0x20 && op <= 0x22)
+            cfg_leader(g, image[pc + 1] | image[pc + 2] << 8);
+        if (op == 0x20 || op == 0x08)
+            break;
+        pc += len;
+        if (op == 0x21 || op == 0x22) {
+            cfg_leader(g, pc);
+            break;
+        }
+    }
+}
+
+/*
+ * Cut the marked instructions into blocks, and run each over the values
+ * its immediates pin down (-1: unknown), collecting the constant stores.
+ */
+static size_t cfg_blocks(struct cfg *g, const uint8_t *image, struct cfg_store **stores, size_t *cap) {
+    size_t nstores = 0;
+
+    g->nblocks = 0;
+    for (uint32_t start = 0; start < SRAM_START; start++) {
+        if ((g->flags[start] & (CFG_LEADER | CFG_INSN)) != (CFG_LEADER | CFG_INSN))
+            continue;
+        struct cfg_block *b = &g->blocks[g->nblocks++];
+        int a = -1, d0 = -1, t[2] = { -1, -1 };
+        uint32_t pc = start;
+
+        *b = (struct cfg_block){ .pc = start, .t_src = { -1, -1 } };
+        for (;;) {
+            uint8_t op = image[pc];
+            unsigned len = op_length[op];
+            uint16_t imm = len == 3 ? image[pc + 1] | image[pc + 2] << 8 : image[pc + 1];
+
+            switch (op) {
+            case 0x00: a = imm; break;
+            case 0x01: d0 = imm & 0xFF; break;
+            case 0x03: d0 = a >= 0 && a < SRAM_START ? image[a] : -1; break;
+            case 0x05:
+            case 0x06:
+                t[op - 0x05] = a >= 0 && a < SRAM_START ? image[a] : -1;
+                b->t_src[op - 0x05] = a;
+                break;
+            case 0x07: a = t[0] >= 0 && t[1] >= 0 ? t[1] << 8 | t[0] : -1; break;
+            case 0x60:
+                if (a >= SRAM_START && d0 >= 0) {
+                    if (nstores == *cap) {
+                        *cap = *cap ? 2 * *cap : 1024;
+                        *stores = realloc(*stores, *cap * sizeof(**stores));
+                        if (!*stores) {
+                            fprintf(stderr, "out of memory\n");
+                            exit(1);
+                        }
+                    }
+                    (*stores)[nstores++] = (struct cfg_store){ start, a, d0 };
+                }
+                break;
+            default:
+                if (op >= 0x61 && op <= 0x71 && (op & 1))
+                    d0 = -1;
+            }
+            pc += len;
+
+            if (op >= 0x20 && op <= 0x22)
+                b->succ[b->nsucc++] = imm;
+            if ((op == 0x21 || op == 0x22) && pc < SRAM_START)
+                b->succ[b->nsucc++] = pc;
+            if (op == 0x08) {
+                if (t[0] >= 0 && t[1] >= 0) {
+                    /* Both halves came from ROM: not so indirect after all */
+                    b->succ[b->nsucc++] = t[1] << 8 | t[0];
+                    cfg_leader(g, t[1] << 8 | t[0]);
+                } else {
+                    b->indirect = true;
+                }
+            }
+            if (op == 0x08 || (op >= 0x20 && op <= 0x22))
+                break;
+            if (pc >= SRAM_START || (g->flags[pc] & (CFG_LEADER | CFG_INSN)) != CFG_INSN) {
+                /* Falls into the next block, or off the marked code */
+                if (pc < SRAM_START && (g->flags[pc] & CFG_INSN))
+                    b->succ[b->nsucc++] = pc;
+                break;
+            }
+        }
+        b->end = pc;
+    }
+    return nstores;
+}
+
+/*
+ * Give each indirect jump the return addresses stored where it loads T
+ * from: a block that stores both halves, as the address just past its
+ * own jump.  The same bytes also hold other things (program.hex zeroes
+ * them, and passes arguments in them), and those aren't code.
+ */
+static void cfg_resolve(struct cfg *g, const struct cfg_store *stores, size_t nstores) {
+    size_t first = 0;
+
+    g->nedges = 0;
+    for (size_t s = 0; s < nstores; s = first) {
+        const struct cfg_block *caller = g->blocks;
+        while (caller->pc != stores[s].block)
+            caller++;
+        for (first = s; first < nstores && stores[first].block == stores[s].block; first++)
+            ;
+        for (size_t i = 0; i < g->nblocks; i++) {
+            const struct cfg_block *b = &g->blocks[i];
+            if (!b->indirect || b->t_src[0] < SRAM_START || b->t_src[1] < SRAM_START)
+                continue;
+            int half[2] = { -1, -1 };
+            for (size_t e = s; e < first; e++) {
+                for (int h = 0; h < 2; h++) {
+                    if (stores[e].addr == b->t_src[h])
+                        half[h] = stores[e].value;
+                }
+            }
+            uint16_t to = half[1] << 8 | half[0];
+            if (half[0] < 0 || half[1] < 0 || to != caller->end)
+                continue;
+
+            bool seen = false;
+            for (size_t k = 0; k < g->nedges && !seen; k++)
+                seen = g->edges[k].from == b->pc && g->edges[k].to == to;
+            if (seen)
+                continue;
+            g->edges = realloc(g->edges, (g->nedges + 1) * sizeof(*g->edges));
+            if (!g->edges) {
+                fprintf(stderr, "out of memory\n");
+                exit(1);
+            }
+            g->edges[g->nedges++] = (struct cfg_edge){ b->pc, to };
+            if (to < SRAM_START) {
+                cfg_leader(g, to);
+                g->flags[to] |= CFG_VIA_T;
+            }
+        }
+    }
+}
+
+static struct cfg *cfg_build(const uint8_t *image, uint16_t entry) {
+    struct cfg *g = xcalloc(1, sizeof(*g));
+    struct cfg_store *stores = NULL;
+    size_t nstores = 0, cap = 0;
+
+    g->work = xcalloc(SRAM_START, sizeof(*g->work));
+    g->blocks = xcalloc(SRAM_START, sizeof(*g->blocks));
+    cfg_leader(g, entry);
+    while (g->nwork) {
+        while (g->nwork)
+            cfg_follow(g, image, g->work[--g->nwork]);
+        nstores = cfg_blocks(g, image, &stores, &cap);
+        cfg_resolve(g, stores, nstores);
+    }
+    free(stores);
+    free(g->work);
+    g->work = NULL;
+
+    for (uint32_t pc = 0; pc < SRAM_START; pc++)
+        g->code_bytes += (g->flags[pc] & (CFG_INSN | CFG_OPERAND)) != 0;
+    return g;
+}
+
+static void cfg_free(struct cfg *g) {
+    free(g->blocks);
+    free(g->edges);
+    free(g);
+}
+
+/*
+ * -D: list the ROM.  Code the graph reaches is disassembled, one block at
+ * a time, with where indirect jumps go; everything else is shown as data,
+ * with long runs of zeros folded into one line.
+ */
+static void disassemble(const uint8_t *image, uint16_t entry, FILE *f) {
+    struct cfg *g = cfg_build(image, entry);
+    size_t nind = 0;
+
+    for (size_t i = 0; i < g->nblocks; i++)
+        nind += g->blocks[i].indirect;
+    fprintf(f, "; entry %04X: %zu block%s, %zu bytes of code, %zu indirect jump%s to %zu place%s\n",
+            entry, g->nblocks, g->nblocks == 1 ? "" : "s", g->code_bytes,
+            nind, nind == 1 ? "" : "s", g->nedges, g->nedges == 1 ? "" : "s");
+
+    size_t bi = 0;
+    for (uint32_t pc = 0; pc < SRAM_START; ) {
+        if (!(g->flags[pc] & (CFG_LEADER | CFG_INSN | CFG_OPERAND))) {
+            uint32_t end = pc;
+            while (end < SRAM_START && !(g->flags[end] & (CFG_LEADER | CFG_INSN | CFG_OPERAND)))
+                end++;
+            while (pc < end) {
+                uint32_t zeros = pc;
+                while (zeros < end && !image[zeros])
+                    zeros++;
+                if (zeros - pc >= 16) {
+                    fprintf(f, "\n%04X  ds %u\n", pc, zeros - pc);
+                    pc = zeros;
+                    continue;
+                }
+                fprintf(f, "%04X  db", pc);
+                for (uint32_t n = 0; n < 8 && pc < end; n++)
+                    fprintf(f, " %02X", image[pc++]);
+                fputc('\n', f);
+            }
+            continue;
+        }
+
+        while (bi < g->nblocks && g->blocks[bi].pc < pc)
+            bi++;
+        if (bi == g->nblocks || g->blocks[bi].pc != pc) {
+            /* Operand bytes of an instruction that runs into this one */
+            fprintf(f, "%04X  db %02X\n", pc, image[pc]);
+            pc++;
+            continue;
+        }
+
+        const struct cfg_block *b = &g->blocks[bi];
+        fprintf(f, "\n%04X:%s%s\n", pc, pc == entry ? "  ; entry" : "",
+                g->flags[pc] & CFG_VIA_T ? "  ; via jmp T" : "");
+        for (pc = b->pc; pc < b->end; ) {
+            pc += disasm(f, image, pc);
+            fputc('\n', f);
+        }
+        if (b->indirect) {
+            int n = 0;
+            for (size_t k = 0; k < g->nedges; k++) {
+                if (g->edges[k].from != b->pc)
+                    continue;
+                fprintf(f, n % 8 ? " %04X" : n ? "\n      ;    %04X" : "      ; -> %04X", g->edges[k].to);
+                n++;
+            }
+            fputs(n ? "\n" : "      ; -> unknown\n", f);
+        }
+    }
+    cfg_free(g);
+}
+
+/* ================= Recompiler ================= */
+
+/*
+ * -A OUT writes the ROM out as C: a file that includes this one with
+ * DUOVM_AOT defined and adds aot_run(), which run() then uses for that
+ * ROM in place of the interpreter.  Each block of the static CFG becomes
+ * a label followed by the block's op_* handlers, called with their
+ * operands as constants.  0x20-0x22 are plain gotos, and jmp T is a
+ * switch over the targets the CFG found that start a block.  Any other PC
+ * goes through the dispatch switch: SRAM, code the CFG missed, an
+ * instruction straddling SRAM_START, or the middle of a block after a
+ * parked 0xA0.  The switch interprets one instruction at a time until it
+ * reaches the start of a block again.
+ *
+ * The instruction budget is taken a whole block at a time.  Only stores,
+ * 0xA0 and undefined opcodes can stop a machine, so only they set PC
+ * first and check vm->stop after.
+ */
+/* Whether `to` starts a block, and so has a B_ label to jump to */
+static bool aot_label(const struct cfg *g, uint32_t to) {
+    return to < SRAM_START && (g->flags[to] & (CFG_LEADER | CFG_INSN)) == (CFG_LEADER | CFG_INSN);
+}
+
+static void aot_goto(FILE *f, const struct cfg *g, uint32_t to) {
+    if (aot_label(g, to))
+        fprintf(f, "goto B_%04X;\n", to);
+    else
+        fprintf(f, "{ vm->PC = 0x%04X; goto dispatch; }\n", to & 0xFFFF);
+}
+
+static void recompile(const uint8_t *image, uint16_t entry, uint32_t rom_hash, const char *src, const char *path) {
+    struct cfg *g = cfg_build(image, entry);
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        perror(path);
+        exit(1);
+    }
+
+    fprintf(f, "/*\n * %s, recompiled by duovm -A.  Build it like duovm itself, with\n"
+               " * duovm.c on the include path.\n */\n", src);
+    fprintf(f, "#define DUOVM_AOT 1\n#include \"duovm.c\"\n\n");
+    fprintf(f, "static const uint32_t aot_rom_hash = 0x%08X;\n\n", rom_hash);
+    fprintf(f, "static long aot_run(DuoVM *vm, long n) {\n    long left = n;\n\n");
+    fprintf(f, "dispatch:\n    if (left <= 0 || vm->stop)\n        return n - left;\n    switch (vm->PC) {\n");
+    for (size_t i = 0; i < g->nblocks; i++)
+        fprintf(f, "    case 0x%04X: goto B_%04X;\n", g->blocks[i].pc, g->blocks[i].pc);
+    fprintf(f, "    }\n    left -= interp_run(vm, 1);\n    goto dispatch;\n");
+
+    for (size_t i = 0; i < g->nblocks; i++) {
+        const struct cfg_block *b = &g->blocks[i];
+        int insns = 0, cycles = 0;
+        for (uint32_t pc = b->pc; pc < b->end; pc += op_length[image[pc]]) {
+            insns++;
+            cycles += op_cycles[image[pc]];
+        }
+
+        fprintf(f, "\nB_%04X:\n", b->pc);
+        fprintf(f, "    if (left < %d) {\n        vm->PC = 0x%04X;\n"
+                   "        return n - left + interp_run(vm, left);\n    }\n", insns, b->pc);
+        fprintf(f, "    left -= %d;\n    vm->cycles += %d;\n", insns, cycles);
+
+        int after = insns, cycles_after = cycles;
+        uint32_t pc = b->pc;
+        uint8_t op = 0;
+        while (pc < b->end) {
+            op = image[pc];
+            unsigned len = op_length[op];
+            uint32_t next = pc + len;
+            uint16_t arg = len == 3 ? image[pc + 1] | image[pc + 2] << 8 :
+                           len == 2 ? image[pc + 1] : 0;
+            after--;
+            cycles_after -= op_cycles[op];
+
+            if (op == 0x20) {
+                fprintf(f, "    ");
+                aot_goto(f, g, arg);
+            } else if (op == 0x21 || op == 0x22) {
+                fprintf(f, "    if (%scarry(vm)) ", op == 0x22 ? "!" : "");
+                aot_goto(f, g, arg);
+            } else if (op == 0x08) {
+                fprintf(f, "    switch (vm->T) {\n");
+                for (size_t k = 0; k < g->nedges; k++) {
+                    uint16_t to = g->edges[k].to;
+                    if (g->edges[k].from == b->pc && aot_label(g, to))
+                        fprintf(f, "    case 0x%04X: goto B_%04X;\n", to, to);
+                }
+                fprintf(f, "    }\n    vm->PC = vm->T;\n    goto dispatch;\n");
+            } else if (OP_STORES(op) || !op_names[op]) {
+                fprintf(f, "    vm->PC = 0x%04X;\n", next);
+                if (op_names[op])
+                    fprintf(f, "    op_%s(vm, 0);\n", op_names[op]);
+                else
+                    fprintf(f, "    op_undefined(vm, 0x%02X);\n", op);
+                if (after)
+                    fprintf(f, "    if (vm->stop) {\n        vm->cycles -= %d;\n"
+                               "        return n - left - %d;\n    }\n", cycles_after, after);
+                else
+                    fprintf(f, "    if (vm->stop)\n        return n - left;\n");
+            } else {
+                fprintf(f, "    op_%s(vm, 0x%X);\n", op_names[op], arg);
+            }
+            pc = next;
+        }
+        if (op != 0x20 && op != 0x08) {
+            fprintf(f, "    ");
+            aot_goto(f, g, b->end);
+        }
+    }
+    fprintf(f, "}\n");
+    if (fclose(f)) {
+        perror(path);
+        exit(1);
+    }
+    cfg_free(g);
+}
+
+/* ================= Profile report ================= */
+
+#ifdef DUOVM_PROFILE
+
+#define PROF_TOP 20
+
+static const char *prof_folded_path = "duovm.folded";  /* -P */
+
+struct prof_row {
+    uint64_t count;
+    uint32_t key;
+};
+
+static int prof_by_count(const void *a, const void *b) {
+    const struct prof_row *x = a, *y = b;
+    if (x->count != y->count)
+        return x->count < y->count ? 1 : -1;
+    return x->key < y->key ? -1 : x->key > y->key;
+}
+
+static int prof_by_key(const void *a, const void *b) {
+    const struct prof_row *x = a, *y = b;
+    return x->key < y->key ? -1 : x->key > y->key;
+}
+
+static void prof_calls(FILE *f, const char *what, uint64_t calls, uint64_t ticks) {
+    fprintf(f, "  %-16s %12llu calls %14llu " PROF_TICKS " %10.1f per call\n", what,
+            (unsigned long long)calls, (unsigned long long)ticks,
+            calls ? (double)ticks / calls : 0.0);
+}
+
+/*
+ * Hot spots, opcode mix and display cost to f; with folded_path, also
+ * one "duovm;loc_FRAME;PC:op count" line per (frame, PC) for
+ * flamegraph.pl.
+ */
+static void prof_report(const struct profile *p, FILE *f, const char *folded_path) {
+    struct prof_row *rows = xcalloc(MEM_SIZE, sizeof(*rows));
+    uint64_t total = 0;
+    size_t n = 0;
+
+    for (uint32_t pc = 0; pc < MEM_SIZE; pc++) {
+        if (p->pc[pc])
+            rows[n++] = (struct prof_row){ p->pc[pc], pc };
+        total += p->pc[pc];
+    }
+    qsort(rows, n, sizeof(*rows), prof_by_count);
+    fprintf(f, "profile: %llu instructions at %zu PCs\n", (unsigned long long)total, n);
+    fprintf(f, "hot spots:\n      PC          count       %%  op\n");
+    for (size_t i = 0; i < n && i < PROF_TOP; i++) {
+        uint8_t op = p->pc_op[rows[i].key];
+        fprintf(f, "    %04X %14llu  %5.1f%%  %s\n", rows[i].key,
+                (unsigned long long)rows[i].count, 100.0 * rows[i].count / total,
+                op_name(op));
+    }
+
+    n = 0;
+    for (int op = 0; op < 256; op++) {
+        if (p->op[op])
+            rows[n++] = (struct prof_row){ p->op[op], op };
+    }
+    qsort(rows, n, sizeof(*rows), prof_by_count);
+    fprintf(f, "opcodes:\n      op  name            count       %%\n");
+    for (size_t i = 0; i < n; i++)
+        fprintf(f, "      %02X  %-9s %14llu  %5.1f%%\n", rows[i].key, op_name(rows[i].key),
+                (unsigned long long)rows[i].count, 100.0 * rows[i].count / total);
+
+    n = 0;
+    for (uint32_t k = 0; k < 256 * 256; k++) {
+        if (p->pair[k >> 8][k & 0xFF])
+            rows[n++] = (struct prof_row){ p->pair[k >> 8][k & 0xFF], k };
+    }
+    qsort(rows, n, sizeof(*rows), prof_by_count);
+    fprintf(f, "straight-line pairs, fusion candidates:\n");
+    for (size_t i = 0; i < n && i < PROF_TOP; i++)
+        fprintf(f, "      %02X %02X  %-9s %-9s %14llu  %5.1f%%\n", rows[i].key >> 8, rows[i].key & 0xFF,
+                op_name(rows[i].key >> 8), op_name(rows[i].key & 0xFF),
+                (unsigned long long)rows[i].count, 100.0 * rows[i].count / total);
+
+    fprintf(f, "display:\n");
+    prof_calls(f, "put_char_vm", p->putc_calls, p->putc_ticks);
+    prof_calls(f, "clear_screen_vm", p->cls_calls, p->cls_ticks);
+    free(rows);
+
+    if (!folded_path)
+        return;
+    rows = xcalloc(p->nedges ? p->nedges : 1, sizeof(*rows));
+    n = 0;
+    for (size_t i = 0; i < p->cap; i++) {
+        if (p->edges[i].count)
+            rows[n++] = (struct prof_row){ p->edges[i].count, p->edges[i].key };
+    }
+    qsort(rows, n, sizeof(*rows), prof_by_key);
+    FILE *out = fopen(folded_path, "w");
+    if (!out) {
+        perror(folded_path);
+        exit(1);
+    }
+    for (size_t i = 0; i < n; i++) {
+        uint16_t pc = rows[i].key & 0xFFFF;
+        fprintf(out, "duovm;loc_%04X;%04X:%s %llu\n", rows[i].key >> 16, pc,
+                op_name(p->pc_op[pc]), (unsigned long long)rows[i].count);
+    }
+    if (fclose(out)) {
+        perror(folded_path);
+        exit(1);
+    }
+    fprintf(f, "folded stacks: %zu lines in %s\n", n, folded_path);
+    free(rows);
+}
+
+#endif /* DUOVM_PROFILE */
+
+/* ================= Memory heatmap ================= */
+
+#ifdef DUOVM_MEM_STATS
+
+#define HEAT_COLS 32            /* grid cells per SRAM page, 8 bytes each */
+
+static const char *heat_path = "duovm.heat";   /* -M */
+static const char *heat_sock;                   /* -m */
+static int heat_fd = -1;
+
+static void heat_add(struct mem_stats *dst, const struct mem_stats *src) {
+    for (int i = 0; i < PAGE_COUNT; i++) {
+        dst->page_reads[i] += src->page_reads[i];
+        dst->page_writes[i] += src->page_writes[i];
+    }
+    for (int i = 0; i < SRAM_SIZE; i++) {
+        dst->reads[i] += src->reads[i];
+        dst->writes[i] += src->writes[i];
+    }
+    dst->machines += src->machines;
+}
+
+/* Keep a machine's counts before it is freed */
+static void heat_retire(const DuoVM *vm) {
+    pthread_mutex_lock(&heat_lock);
+    heat_add(&heat_done, vm->mstats);
+    pthread_mutex_unlock(&heat_lock);
+}
+
+/* heat_done plus the n machines still running; the caller frees it */
+static struct mem_stats *heat_sum(DuoVM *const *live, int n) {
+    struct mem_stats *s = xcalloc(1, sizeof(*s));
+    pthread_mutex_lock(&heat_lock);
+    heat_add(s, &heat_done);
+    pthread_mutex_unlock(&heat_lock);
+    for (int i = 0; i < n; i++)
+        heat_add(s, live[i]->mstats);
+    return s;
+}
+
+static int heat_bits(uint64_t n) { return n ? 64 - __builtin_clzll(n) : 0; }
+
+/*
+ * Totals, then every page that was touched, then SRAM as a grid with a
+ * row per page and a column per 8 bytes, shaded by the log of the
+ * accesses, and last every SRAM address that was touched.
+ */
+static void heat_write(FILE *f, const struct mem_stats *s) {
+    static const char shades[] = " .:-=+*#%@";
+    uint64_t reads = 0, writes = 0, cell[SRAM_SIZE / 8] = { 0 }, max = 0;
+
+    for (int p = 0; p < PAGE_COUNT; p++) {
+        reads += s->page_reads[p];
+        writes += s->page_writes[p];
+    }
+    fprintf(f, "# duovm memory heatmap: %llu reads, %llu writes, %d machine%s\n",
+            (unsigned long long)reads, (unsigned long long)writes,
+            s->machines, s->machines == 1 ? "" : "s");
+
+    fprintf(f, "\n# page         reads        writes\n");
+    for (int p = 0; p < PAGE_COUNT; p++) {
+        if (s->page_reads[p] || s->page_writes[p])
+            fprintf(f, "%02X00 %14llu %13llu\n", p, (unsigned long long)s->page_reads[p],
+                    (unsigned long long)s->page_writes[p]);
+    }
+
+    for (int a = 0; a < SRAM_SIZE; a++) {
+        uint64_t *c = &cell[a / 8];
+        *c += s->reads[a] + s->writes[a];
+        if (*c > max)
+            max = *c;
+    }
+    fprintf(f, "\n# SRAM, 8 bytes a column, '%s' up to %llu accesses\n",
+            shades, (unsigned long long)max);
+    for (int p = 0; p < SRAM_SIZE / 256; p++) {
+        fprintf(f, "%04X |", SRAM_START + p * 256);
+        for (int c = 0; c < HEAT_COLS; c++) {
+            uint64_t n = cell[p * HEAT_COLS + c];
+            fputc(shades[n ? 1 + (heat_bits(n) - 1) * 9 / heat_bits(max) : 0], f);
+        }
+        fputs("|\n", f);
+    }
+
+    fprintf(f, "\n# addr         reads        writes\n");
+    for (int a = 0; a < SRAM_SIZE; a++) {
+        if (s->reads[a] || s->writes[a])
+            fprintf(f, "%04X %14llu %13llu\n", SRAM_START + a, (unsigned long long)s->reads[a],
+                    (unsigned long long)s->writes[a]);
+    }
+}
+
+/* At exit: the heatmap to heat_path, and a one-line summary to stderr */
+static void heat_report(DuoVM *const *live, int n) {
+    struct mem_stats *s = heat_sum(live, n);
+    uint64_t reads = 0, writes = 0;
+    for (int p = 0; p < PAGE_COUNT; p++) {
+        reads += s->page_reads[p];
+        writes += s->page_writes[p];
+    }
+
+    FILE *f = fopen(heat_path, "w");
+    if (f) {
+        heat_write(f, s);
+        fclose(f);
+        fprintf(stderr, "memory: %llu reads, %llu writes; heatmap in %s\n",
+                (unsigned long long)reads, (unsigned long long)writes, heat_path);
+    } else {
+        perror(heat_path);
+    }
+    free(s);
+    if (heat_fd >= 0) {
+        close(heat_fd);
+        unlink(heat_sock);
+    }
+}
+
+/* -m PATH: a Unix socket that hands the heatmap so far to each client */
+static void heat_listen(void) {
+    const char *path = heat_sock;
+    struct sockaddr_un sa = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(sa.sun_path)) {
+        fprintf(stderr, "-m: socket path too long: %s\n", path);
+        exit(1);
+    }
+    strcpy(sa.sun_path, path);
+    unlink(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 || listen(fd, 8) < 0) {
+        perror("-m");
+        exit(1);
+    }
+    heat_fd = fd;
+}
+
+/*
+ * Answer every client waiting on -m with heat_done plus the given
+ * machines.  Each machine calls this between bursts, so its counts never
+ * change under it.  A client gets a second to take the report.
+ */
+static void heat_serve(DuoVM *const *live, int n) {
+    int c;
+    if (heat_fd < 0)
+        return;
+    while ((c = accept4(heat_fd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+        struct timeval limit = { .tv_sec = 1 };
+        struct mem_stats *s = heat_sum(live, n);
+        char *buf = NULL;
+        size_t len = 0;
+        FILE *f = open_memstream(&buf, &len);
+
+        if (f) {
+            heat_write(f, s);
+            fclose(f);
+            setsockopt(c, SOL_SOCKET, SO_SNDTIMEO, &limit, sizeof(limit));
+            for (size_t off = 0; off < len; ) {
+                ssize_t w = send(c, buf + off, len - off, MSG_NOSIGNAL);
+                if (w <= 0)
+                    break;
+                off += w;
+            }
+        }
+        free(buf);
+        free(s);
+        close(c);
+    }
+}
+
+#endif /* DUOVM_MEM_STATS */
+
+/* ================= Benchmarks ================= */
+
+static void bench_line(const char *name, double units, const char *unit, double secs) {
+    printf("%-28s %10.2f M%s/s %10.2f ns/%s\n", name, units / secs / 1e6, unit,
+           secs * 1e9 / units, unit);
+}
+
+/* Old sscanf loader against load_hex() on the same file */
+static void bench_loader(const char *path) {
+    static uint8_t ref[MEM_SIZE], memory[MEM_SIZE];
+    const int iters = 200;
+    struct stat st;
+
+    if (stat(path, &st) < 0) {
+        perror(path);
+        exit(1);
+    }
+
+    memset(memory, 0, sizeof(memory));
+    load_hex_legacy(path, memory);
+    memcpy(ref, memory, sizeof(ref));
+    memset(memory, 0, sizeof(memory));
+    load_hex(path, memory);
+    printf("%-28s %s\n", "load_hex output",
+           memcmp(ref, memory, sizeof(ref)) ? "MISMATCH" : "identical");
+
+    double t0 = now_sec();
+    for (int i = 0; i < iters; i++)
+        load_hex_legacy(path, memory);
+    double t1 = now_sec();
+    for (int i = 0; i < iters; i++)
+        load_hex(path, memory);
+    double t2 = now_sec();
+
+    double bytes = (double)st.st_size * iters;
+    bench_line("load_hex, sscanf", bytes, "B", t1 - t0);
+    bench_line("load_hex, simd", bytes, "B", t2 - t1);
+    printf("%-28s %10.1fx\n", "load_hex speedup", (t1 - t0) / (t2 - t1));
+}
+
+/*
+ * Synthetic loops for raw dispatch speed, each starting at 0000 and
+ * jumping back there forever.
+ */
+static const uint8_t bench_alu[] = {
+    0x01, 0x05,             /* ldd0 05 */
+    0x02, 0x07,             /* ldd1 07 */
+    0x63, 0x65, 0x6B,       /* add_d sub_d xor_d */
+    0x6F, 0x71, 0x67,       /* rol_d ror_d and_d */
+    0x69, 0x6D, 0x40,       /* or_d not_d clc */
+    0x20, 0x00, 0x00,       /* jmp 0000 */
+};
+
+static const uint8_t bench_jump[] = {
+    0x40,                   /* 0000 clc */
+    0x22, 0x05, 0x00,       /* 0001 jnc 0005 */
+    0x00,
+    0x41,                   /* 0005 sec */
+    0x21, 0x0A, 0x00,       /* 0006 jc 000A */
+    0x00,
+    0x00, 0x00, 0xE0,       /* 000A lda E000 */
+    0x05,                   /* 000D ldtl */
+    0x00, 0x01, 0xE0,       /* 000E lda E001 */
+    0x06,                   /* 0011 ldth */
+    0x08,                   /* 0012 jmpt (T = 0000) */
+};
+
+static const uint8_t bench_mem[] = {
+    0x00, 0x10, 0xE0,       /* lda E010 */
+    0x01, 0x01,             /* ldd0 01 */
+    0x60, 0x03, 0x04,       /* mov_m ldd0m ldd1m */
+    0x62,                   /* add_m */
+    0x00, 0x11, 0xE0,       /* lda E011 */
+    0x04, 0x64, 0x6E,       /* ldd1m sub_m rol_m */
+    0x20, 0x00, 0x00,       /* jmp 0000 */
+};
+
+#define BENCH_STEPS 50000000L
+
+/* BENCH_STEPS instructions of a synthetic loop: compiled, cached and interpreted */
+static void bench_mix(const char *name, const uint8_t *code, size_t len) {
+    static const struct { const char *name; bool tc, jit; } modes[] = {
+#ifdef DUOVM_JIT
+        { "jit", true, true },
+#endif
+        { "tc", true, false },
+        { "interp", false, false },
+    };
+    static uint8_t image[MEM_SIZE];
+    bool saved_tc = use_tc, saved_jit = use_jit;
+    char label[64];
+
+    memset(image, 0, sizeof(image));
+    memcpy(image, code, len);
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        /* A fresh ROM each time, so no mode inherits compiled blocks */
+        DuoROM *rom = rom_new(image, 0);
+        use_tc = modes[m].tc;
+        use_jit = modes[m].jit;
+        DuoVM *vm = vm_new(rom);
+        run(vm, 1000000);
+        double t0 = now_sec();
+        for (long done = 0; done < BENCH_STEPS; )
+            done += run(vm, BENCH_STEPS - done);
+        double secs = now_sec() - t0;
+        snprintf(label, sizeof(label), "%s mix, %s", name, modes[m].name);
+        bench_line(label, BENCH_STEPS, "instr", secs);
+        vm_free(vm);
+        rom_free(rom);
+    }
+    use_tc = saved_tc;
+    use_jit = saved_jit;
+}
+
+/* The loaded program run headless to the end of each script, a few times */
+static void bench_program(DuoROM *rom, struct input_trace **scripts, int nscripts) {
+    static const char keys[] = "dddsswdadsdwwasddddssaaw\n\n\ndsdsdsdsawawawa";
+    struct input_trace *builtin = NULL;
+    const struct display *saved_display = display;
+    const int rounds = 5;
+    long long total = 0;
+
+    if (!nscripts) {
+        builtin = parse_input("built-in keys", keys, strlen(keys));
+        scripts = &builtin;
+        nscripts = 1;
+    }
+    display = &display_headless;
+    double t0 = now_sec();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < nscripts; i++) {
+            DuoVM *vm = vm_new(rom);
+            vm->trace = scripts[i];
+            total += run_machine(vm, 0);
+            vm_free(vm);
+        }
+    }
+    bench_line("program, scripted", total, "instr", now_sec() - t0);
+    display = saved_display;
+    if (builtin) {
+        free(builtin->ev);
+        free(builtin);
+    }
+}
+
+/* flush_screen() into a curses screen that writes to /dev/null */
+static void bench_flush(void) {
+    const int iters = 20000;
+    FILE *sink = fopen("/dev/null", "w");
+    SCREEN *scr = sink ? newterm("xterm", sink, stdin) : NULL;
+
+    if (!scr) {
+        printf("%-28s skipped: no xterm terminfo\n", "flush");
+        if (sink)
+            fclose(sink);
+        return;
+    }
+    DuoVM *vm = xcalloc(1, sizeof(*vm));
+    memset(shown, 0, sizeof(shown));
+
+    double t0 = now_sec();
+    for (int i = 0; i < iters; i++) {
+        memset(vm->screen, i & 1 ? 'A' : 'B', sizeof(vm->screen));
+        for (int y = 0; y < SCREEN_H; y++)
+            vm->dirty[y] = (1ULL << SCREEN_W) - 1;
+        flush_screen(vm);
+    }
+    double full = now_sec() - t0;
+
+    t0 = now_sec();
+    for (int i = 0; i < iters; i++) {
+        vm->screen[SCREEN_H / 2][SCREEN_W / 2] = i & 1 ? 'A' : 'B';
+        vm->dirty[SCREEN_H / 2] |= 1ULL << (SCREEN_W / 2);
+        flush_screen(vm);
+    }
+    double one = now_sec() - t0;
+
+    endwin();
+    delscreen(scr);
+    fclose(sink);
+    memset(shown, 0, sizeof(shown));
+    free(vm);
+    bench_line("flush, every cell changed", (double)iters * SCREEN_W * SCREEN_H, "cell", full);
+    bench_line("flush, one cell changed", iters, "frame", one);
+}
+
+/* -b: everything above, on the loaded program where one is needed */
+static void run_benchmarks(const char *path, DuoROM *rom,
+                           struct input_trace **scripts, int nscripts) {
+    bench_mix("alu", bench_alu, sizeof(bench_alu));
+    bench_mix("jump", bench_jump, sizeof(bench_jump));
+    bench_mix("memory", bench_mem, sizeof(bench_mem));
+    if (is_image(path))
+        printf("%-28s skipped: %s is a binary image\n", "load_hex", path);
+    else
+        bench_loader(path);
+    bench_program(rom, scripts, nscripts);
+    bench_flush();
+}
+
+/* ================= Lockstep lanes ================= */
+
+/*
+ * Machines running the same program tend to run the same code, and
+ * machines replaying the same script run exactly the same code.  Up to
+ * LANES machines at one PC form a group that executes each instruction
+ * once for all of them: the instruction is decoded once, D0, D1 and the
+ * carry of every lane sit side by side in a vector so the ALU ops act
+ * on all lanes at once, and only memory, input and the display go lane
+ * by lane into each machine's own state.  When lanes disagree on a
+ * conditional jump or a jmp T, each one takes its own way and the group
+ * breaks up; groups re-form from whichever machines share a PC, and a
+ * machine alone at its PC runs through run() as usual.  Code in SRAM can
+ * differ between machines, so that runs through run() too.
+ *
+ * The vectors are SSE2 or NEON, or plain arrays without either.  The
+ * carry is kept as a mask, 0xFF for set, so it feeds and comes out of
+ * the compares directly.
+ */
+#define LANES      16
+#define LANE_MIN   4        /* smallest group worth running, on measurements with program.hex */
+#define LANE_SOLO  4096     /* instructions a machine outside any group runs between regroups */
+
+/*
+ * Compiled blocks beat even a full group, since every lane still loads and
+ * stores its own memory one byte at a time; with the JIT, -L has to ask.
+ */
+#ifdef DUOVM_JIT
+#define LANES_DEFAULT 1
+#else
+#define LANES_DEFAULT LANES
+#endif
+
+#if defined(DUOVM_SSE2)
+
+typedef __m128i lane8;
+static inline lane8 l8_load(const uint8_t *p)     { return _mm_load_si128((const __m128i *)p); }
+static inline void  l8_store(uint8_t *p, lane8 v) { _mm_store_si128((__m128i *)p, v); }
+static inline lane8 l8_splat(uint8_t v)           { return _mm_set1_epi8((char)v); }
+static inline lane8 l8_add(lane8 a, lane8 b)      { return _mm_add_epi8(a, b); }
+static inline lane8 l8_sub(lane8 a, lane8 b)      { return _mm_sub_epi8(a, b); }
+static inline lane8 l8_and(lane8 a, lane8 b)      { return _mm_and_si128(a, b); }
+static inline lane8 l8_or(lane8 a, lane8 b)       { return _mm_or_si128(a, b); }
+static inline lane8 l8_xor(lane8 a, lane8 b)      { return _mm_xor_si128(a, b); }
+static inline lane8 l8_eq(lane8 a, lane8 b)       { return _mm_cmpeq_epi8(a, b); }
+static inline lane8 l8_adds(lane8 a, lane8 b)     { return _mm_adds_epu8(a, b); }
+static inline lane8 l8_min(lane8 a, lane8 b)      { return _mm_min_epu8(a, b); }
+static inline lane8 l8_shl1(lane8 a)              { return _mm_add_epi8(a, a); }
+static inline lane8 l8_shr1(lane8 a)              { return _mm_and_si128(_mm_srli_epi16(a, 1), _mm_set1_epi8(0x7F)); }
+static inline lane8 l8_msb(lane8 a)               { return _mm_cmplt_epi8(a, _mm_setzero_si128()); }
+static inline unsigned l8_bits(lane8 m)           { return _mm_movemask_epi8(m); }
+
+#elif defined(DUOVM_NEON)
+
+typedef uint8x16_t lane8;
+static inline lane8 l8_load(const uint8_t *p)     { return vld1q_u8(p); }
+static inline void  l8_store(uint8_t *p, lane8 v) { vst1q_u8(p, v); }
+static inline lane8 l8_splat(uint8_t v)           { return vdupq_n_u8(v); }
+static inline lane8 l8_add(lane8 a, lane8 b)      { return vaddq_u8(a, b); }
+static inline lane8 l8_sub(lane8 a, lane8 b)      { return vsubq_u8(a, b); }
+static inline lane8 l8_and(lane8 a, lane8 b)      { return vandq_u8(a, b); }
+static inline lane8 l8_or(lane8 a, lane8 b)       { return vorrq_u8(a, b); }
+static inline lane8 l8_xor(lane8 a, lane8 b)      { return veorq_u8(a, b); }
+static inline lane8 l8_eq(lane8 a, lane8 b)       { return vceqq_u8(a, b); }
+static inline lane8 l8_adds(lane8 a, lane8 b)     { return vqaddq_u8(a, b); }
+static inline lane8 l8_min(lane8 a, lane8 b)      { return vminq_u8(a, b); }
+static inline lane8 l8_shl1(lane8 a)              { return vshlq_n_u8(a, 1); }
+static inline lane8 l8_shr1(lane8 a)              { return vshrq_n_u8(a, 1); }
+static inline lane8 l8_msb(lane8 a)               { return vreinterpretq_u8_s8(vshrq_n_s8(vreinterpretq_s8_u8(a), 7)); }
+
+static inline unsigned l8_bits(lane8 m) {
+    static const uint8_t weight[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    uint8x16_t b = vandq_u8(m, vld1q_u8(weight));
+    return vaddv_u8(vget_low_u8(b)) | vaddv_u8(vget_high_u8(b)) << 8;
+}
+
+#else
+
+typedef struct { uint8_t b[LANES]; } lane8;
+
+#define L8_MAP(expr) \
+    lane8 r;         \
+    for (int i = 0; i < LANES; i++) r.b[i] = (expr); \
+    return r
+
+static inline lane8 l8_load(const uint8_t *p)     { lane8 r; memcpy(r.b, p, LANES); return r; }
+static inline void  l8_store(uint8_t *p, lane8 v) { memcpy(p, v.b, LANES); }
+static inline lane8 l8_splat(uint8_t v)           { L8_MAP(v); }
+static inline lane8 l8_add(lane8 a, lane8 b)      { L8_MAP(a.b[i] + b.b[i]); }
+static inline lane8 l8_sub(lane8 a, lane8 b)      { L8_MAP(a.b[i] - b.b[i]); }
+static inline lane8 l8_and(lane8 a, lane8 b)      { L8_MAP(a.b[i] & b.b[i]); }
+static inline lane8 l8_or(lane8 a, lane8 b)       { L8_MAP(a.b[i] | b.b[i]); }
+static inline lane8 l8_xor(lane8 a, lane8 b)      { L8_MAP(a.b[i] ^ b.b[i]); }
+static inline lane8 l8_eq(lane8 a, lane8 b)       { L8_MAP(a.b[i] == b.b[i] ? 0xFF : 0); }
+static inline lane8 l8_adds(lane8 a, lane8 b)     { L8_MAP(a.b[i] + b.b[i] > 0xFF ? 0xFF : a.b[i] + b.b[i]); }
+static inline lane8 l8_min(lane8 a, lane8 b)      { L8_MAP(a.b[i] < b.b[i] ? a.b[i] : b.b[i]); }
+static inline lane8 l8_shl1(lane8 a)              { L8_MAP(a.b[i] << 1); }
+static inline lane8 l8_shr1(lane8 a)              { L8_MAP(a.b[i] >> 1); }
+static inline lane8 l8_msb(lane8 a)               { L8_MAP(a.b[i] & 0x80 ? 0xFF : 0); }
+
+static inline unsigned l8_bits(lane8 m) {
+    unsigned bits = 0;
+    for (int i = 0; i < LANES; i++)
+        bits |= (m.b[i] >> 7) << i;
+    return bits;
+}
+
+#undef L8_MAP
+
+#endif
+
+/* A group of machines at one PC, with their registers lane by lane */
+struct lanes {
+    int n;
+    DuoVM *vm[LANES];
+    _Alignas(16) uint8_t d0[LANES];
+    _Alignas(16) uint8_t d1[LANES];
+    _Alignas(16) uint8_t c[LANES];      /* carry: 0xFF or 0 */
+    uint16_t a[LANES];
+    uint16_t t[LANES];
+    uint8_t *mem[LANES];                /* each machine's memory and page flags */
+    const uint8_t *flags[LANES];
+};
+
+/* The result of ALU op 0..8 (mov, add, ..., ror) in every lane, and its carry */
+static lane8 lanes_alu(struct lanes *l, int alu) {
+    const lane8 ones = l8_splat(0xFF);
+    lane8 a = l8_load(l->d0), b = l8_load(l->d1), c = l8_load(l->c);
+    lane8 r, sum, diff;
+
+    switch (alu) {
+    case 1:
+        /* Carry out of D0 + D1, or out of the + 1 after it; c is -1 when set */
+        sum = l8_add(a, b);
+        r = l8_sub(sum, c);
+        c = l8_or(l8_xor(l8_eq(l8_adds(a, b), sum), ones), l8_and(l8_eq(sum, ones), c));
+        l8_store(l->c, c);
+        return r;
+    case 2:
+        /* Borrow: D1 > D0, or they're equal and the carry takes one more */
+        diff = l8_sub(a, b);
+        r = l8_add(diff, c);
+        c = l8_or(l8_xor(l8_eq(l8_min(a, b), b), ones), l8_and(l8_eq(diff, l8_splat(0)), c));
+        l8_store(l->c, c);
+        return r;
+    case 3: return l8_and(a, b);
+    case 4: return l8_or(a, b);
+    case 5: return l8_xor(a, b);
+    case 6: return l8_xor(a, ones);
+    case 7:
+        r = l8_sub(l8_shl1(a), c);
+        l8_store(l->c, l8_msb(a));
+        return r;
+    case 8:
+        r = l8_or(l8_shr1(a), l8_and(c, l8_splat(0x80)));
+        l8_store(l->c, l8_eq(l8_and(a, l8_splat(1)), l8_splat(1)));
+        return r;
+    }
+    return a;
+}
+
+static void lanes_load(struct lanes *l) {
+    for (int i = 0; i < l->n; i++) {
+        const DuoVM *vm = l->vm[i];
+        l->d0[i] = vm->D0;
+        l->d1[i] = vm->D1;
+        l->c[i] = carry(vm) ? 0xFF : 0;
+        l->a[i] = vm->A;
+        l->t[i] = vm->T;
+        l->mem[i] = vm->memory;
+        l->flags[i] = vm->page_flags;
+    }
+}
+
+/* Back into the machines; pc < 0 leaves each one's PC as already set */
+static void lanes_save(struct lanes *l, int pc) {
+    for (int i = 0; i < l->n; i++) {
+        DuoVM *vm = l->vm[i];
+        vm->D0 = l->d0[i];
+        vm->D1 = l->d1[i];
+        set_carry(vm, l->c[i]);
+        vm->A = l->a[i];
+        vm->T = l->t[i];
+        if (pc >= 0)
+            vm->PC = pc;
+    }
+}
+
+/*
+ * Run the group in lockstep for up to n instructions, each of which they
+ * all execute.  Stops after a jump that splits it, after any lane stops,
+ * or before code it can't run together; returns the instructions run.
+ */
+static long lanes_run(struct lanes *l, long n) {
+    const struct predecode *code = l->vm[0]->code;
+    const unsigned all = (1u << l->n) - 1;
+    uint16_t pc = l->vm[0]->PC;
+    bool split = false;
+    long done = 0;
+    uint64_t cycles = 0;
+
+    lanes_load(l);
+    while (!split && done < n && pc < SRAM_START && code[pc].len) {
+        const struct predecode *d = &code[pc];
+        uint16_t arg = d->arg, next = pc + d->len;
+        unsigned taken;
+        uint8_t r[LANES];
+
+        switch (d->op) {
+        case 0x00:
+            for (int i = 0; i < l->n; i++)
+                l->a[i] = arg;
+            break;
+        case 0x01: memset(l->d0, arg, LANES); break;
+        case 0x02: memset(l->d1, arg, LANES); break;
+        case 0x03:
+        case 0x04:
+            for (int i = 0; i < l->n; i++)
+                (d->op == 0x03 ? l->d0 : l->d1)[i] = l->mem[i][l->a[i]];
+            break;
+        case 0x05:
+            for (int i = 0; i < l->n; i++)
+                l->t[i] = (l->t[i] & 0xFF00) | l->mem[i][l->a[i]];
+            break;
+        case 0x06:
+            for (int i = 0; i < l->n; i++)
+                l->t[i] = (l->t[i] & 0x00FF) | l->mem[i][l->a[i]] << 8;
+            break;
+        case 0x07: memcpy(l->a, l->t, sizeof(l->a)); break;
+        case 0x08:
+            next = l->t[0];
+            for (int i = 1; i < l->n; i++)
+                split |= l->t[i] != next;
+            if (split) {
+                for (int i = 0; i < l->n; i++)
+                    l->vm[i]->PC = l->t[i];
+            }
+            break;
+        case 0x20: next = arg; break;
+        case 0x21:
+        case 0x22:
+            taken = l8_bits(l8_load(l->c)) & all;
+            if (d->op == 0x22)
+                taken ^= all;
+            if (taken == all) {
+                next = arg;
+            } else if (taken) {
+                for (int i = 0; i < l->n; i++)
+                    l->vm[i]->PC = taken >> i & 1 ? arg : next;
+                split = true;
+            }
+            break;
+        case 0x40: memset(l->c, 0, LANES); break;
+        case 0x41: memset(l->c, 0xFF, LANES); break;
+        case 0xA2:
+        case 0xA3:
+            for (int i = 0; i < l->n; i++) {
+                DuoVM *vm = l->vm[i];
+                *(d->op == 0xA2 ? &vm->cur_x : &vm->cur_y) = l->mem[i][l->a[i]];
+            }
+            break;
+        case 0x61 ... 0x71:
+            if (d->op & 1) {
+                l8_store(l->d0, lanes_alu(l, (d->op - 0x60) >> 1));
+                break;
+            }
+            /* fall through */
+        case 0x60:
+            l8_store(r, lanes_alu(l, (d->op - 0x60) >> 1));
+            for (int i = 0; i < l->n; i++) {
+                uint16_t a = l->a[i];
+                if (l->flags[i][a >> PAGE_SHIFT] == PAGE_WRITE) {
+                    l->mem[i][a] = r[i];
+                } else {
+                    l->vm[i]->PC = next;
+                    mem_write_slow(l->vm[i], a, r[i]);
+                    split |= l->vm[i]->stop != 0;
+                }
+            }
+            if (split) {
+                for (int i = 0; i < l->n; i++)
+                    l->vm[i]->PC = next;
+            }
+            break;
+        default:
+            /* Input, the display and undefined opcodes go machine by machine */
+            for (int i = 0; i < l->n; i++) {
+                DuoVM *vm = l->vm[i];
+                vm->PC = next;
+                vm->A = l->a[i];
+                switch (d->op) {
+                case 0xA0: op_in(vm, 0); break;
+                case 0xA1: op_putc(vm, 0); break;
+                case 0xA4: op_cls(vm, 0); break;
+                default: op_undefined(vm, d->op); break;
+                }
+                split |= vm->stop != 0;
+            }
+            break;
+        }
+        done++;
+        cycles += op_cycles[d->op];
+        pc = next;
+    }
+    for (int i = 0; i < l->n; i++)
+        l->vm[i]->cycles += cycles;
+    lanes_save(l, split ? -1 : pc);
+    return done;
+}
+
+/* One machine in run_lanes(), and where it is in run_machine()'s loop */
+struct lane_machine {
+    DuoVM *vm;
+    long long executed;
+    long left;          /* of the current burst */
+    bool done;
+};
+
+/* Start a burst the way run() would */
+static void lane_begin(struct lane_machine *m, long long max_steps) {
+    m->left = RUN_BURST;
+    if (max_steps && max_steps - m->executed < m->left)
+        m->left = max_steps - m->executed;
+    if ((m->vm->stop & STOP_INPUT) && !resume_input(m->vm))
+        m->left = 0;
+}
+
+/* Count n more instructions; at the end of a burst, do what run_machine() does */
+static void lane_account(struct lane_machine *m, long n, long long max_steps) {
+    DuoVM *vm = m->vm;
+
+    m->executed += n;
+    vm->icount += n;
+    vm->executed += n;
+    m->left -= n;
+    if (metrics_due(vm))
+        metrics_line(stderr, "machine", vm, 0);
+    while (!m->done && (m->left == 0 || vm->stop)) {
+        if (max_steps && m->executed >= max_steps) {
+            m->done = true;
+            break;
+        }
+        if (vm->stop & STOP_INPUT) {
+            double t0 = now_sec();
+            if (!wait_input(vm))
+                vm->running = false;
+            vm->wait_time += now_sec() - t0;
+        } else if (idle_loop(vm)) {
+            vm->running = false;
+            vm->halted = true;
+        }
+        if (!vm->running)
+            m->done = true;
+        else
+            lane_begin(m, max_steps);
+    }
+}
+
+/*
+ * run_machine() for up to LANES headless, unpaced machines at once, with
+ * every machine ending exactly as it would have alone
+ */
+static void run_lanes(struct lane_machine *m, int count, long long max_steps) {
+    struct lanes l;
+
+    for (int i = 0; i < count; i++) {
+        m[i].executed = 0;
+        m[i].done = !m[i].vm->running;
+        if (!m[i].done) {
+            lane_begin(&m[i], max_steps);
+            lane_account(&m[i], 0, max_steps);
+        }
+    }
+
+    for (;;) {
+        int lead = 0, member[LANES];
+        while (lead < count && m[lead].done)
+            lead++;
+        if (lead == count)
+            break;
+
+        uint16_t pc = m[lead].vm->PC;
+        long budget = m[lead].left;
+        l.n = 0;
+        for (int i = lead; i < count; i++) {
+            if (m[i].done || m[i].vm->PC != pc)
+                continue;
+            member[l.n] = i;
+            l.vm[l.n++] = m[i].vm;
+            if (m[i].left < budget)
+                budget = m[i].left;
+        }
+
+        /* A lockstep run's time is shared out evenly among its lanes */
+        double t0 = now_sec();
+        long k = l.n >= LANE_MIN ? lanes_run(&l, budget) : 0;
+        if (k) {
+            double share = (now_sec() - t0) / l.n;
+            for (int j = 0; j < l.n; j++) {
+                l.vm[j]->run_time += share;
+                lane_account(&m[member[j]], k, max_steps);
+            }
+        } else {
+            DuoVM *vm = m[lead].vm;
+            long solo = m[lead].left < LANE_SOLO ? m[lead].left : LANE_SOLO;
+            long n = run(vm, solo);
+            vm->run_time += now_sec() - t0;
+            lane_account(&m[lead], n, max_steps);
+        }
+    }
+}
+
+/* ================= Instance pool ================= */
+
+/*
+ * Runs `count` headless machines from one loaded program on a pool of
+ * worker threads.  Machine i takes input script i modulo the number of
+ * scripts given.
+ */
+struct pool_result {
+    long long executed;
+    uint16_t  pc;
+    uint32_t  screen_hash;
+    bool      trace_failed;
+};
+
+struct pool {
+    DuoROM *rom;
+    long long max_steps;
+    struct input_trace **scripts;
+    int nscripts;
+    const uint8_t *snapshot;    /* every machine starts from this, if set */
+    size_t snapshot_len;
+    int count;
+    int lanes;                  /* machines a worker runs in lockstep, 1 to LANES */
+    atomic_int next;
+    struct pool_result *results;
+#ifdef DUOVM_PROFILE
+    struct profile *prof;       /* every machine's counts, merged */
+    pthread_mutex_t prof_lock;
+#endif
+};
+
+/* A fresh machine for job i */
+static DuoVM *pool_machine(struct pool *p, int i) {
+    DuoVM *vm = vm_new(p->rom);
+    if (p->snapshot)
+        vm_restore(vm, p->snapshot, p->snapshot_len);
+    if (p->nscripts)
+        vm->trace = p->scripts[i % p->nscripts];
+    return vm;
+}
+
+/* Takes p->lanes machines at a time, and runs them as lanes if that's more than one */
+static void *pool_worker(void *arg) {
+    struct pool *p = arg;
+    struct lane_machine m[LANES];
+    int i;
+
+    while ((i = atomic_fetch_add(&p->next, p->lanes)) < p->count) {
+        int n = p->count - i < p->lanes ? p->count - i : p->lanes;
+        for (int j = 0; j < n; j++)
+            m[j].vm = pool_machine(p, i + j);
+        if (n > 1)
+            run_lanes(m, n, p->max_steps);
+        else
+            m[0].executed = run_machine(m[0].vm, p->max_steps);
+
+        for (int j = 0; j < n; j++) {
+            DuoVM *vm = m[j].vm;
+            struct pool_result *r = &p->results[i + j];
+            r->executed = m[j].executed;
+            r->pc = vm->PC;
+            r->screen_hash = fnv1a(&vm->screen[0][0], sizeof(vm->screen));
+            r->trace_failed = vm->trace_failed;
+#ifdef DUOVM_PROFILE
+            pthread_mutex_lock(&p->prof_lock);
+            prof_merge(p->prof, vm->prof);
+            pthread_mutex_unlock(&p->prof_lock);
+#endif
+#ifdef DUOVM_MEM_STATS
+            heat_retire(vm);
+#endif
+            vm_free(vm);
+        }
+    }
+    return NULL;
+}
+
+/* Run fn(arg) on `threads` threads and wait for them all */
+static void run_workers(void *(*fn)(void *), void *arg, int threads) {
+    pthread_t *tids = xcalloc(threads, sizeof(*tids));
+    for (int t = 0; t < threads; t++) {
+        if (pthread_create(&tids[t], NULL, fn, arg)) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (int t = 0; t < threads; t++)
+        pthread_join(tids[t], NULL);
+    free(tids);
+}
+
+/* Returns the number of machines whose timed trace drifted */
+static int run_pool(struct pool *p, int threads) {
+    /* Enough machines per worker to keep every thread busy */
+    int share = (p->count + threads - 1) / threads;
+    if (p->lanes > share)
+        p->lanes = share;
+#if defined(DUOVM_PROFILE) || defined(DUOVM_EXEC_TRACE) || defined(DUOVM_MEM_STATS)
+    p->lanes = 1;           /* lanes have no per-instruction or per-access hooks */
+#endif
+    if (pace_rate || p->lanes < 1)
+        p->lanes = 1;
+
+    p->results = xcalloc(p->count, sizeof(*p->results));
+    atomic_init(&p->next, 0);
+#ifdef DUOVM_PROFILE
+    p->prof = prof_new();
+    pthread_mutex_init(&p->prof_lock, NULL);
+#endif
+
+    double t0 = now_sec();
+    run_workers(pool_worker, p, threads);
+    double elapsed = now_sec() - t0;
+
+    long long total = 0;
+    int failed = 0;
+    for (int i = 0; i < p->count; i++) {
+        struct pool_result *r = &p->results[i];
+        printf("vm %d: %lld instructions, PC=%04X, screen %08X%s\n",
+               i, r->executed, r->pc, r->screen_hash,
+               r->trace_failed ? " (trace mismatch)" : "");
+        total += r->executed;
+        failed += r->trace_failed;
+    }
+    fprintf(stderr, "%d machines on %d threads: %lld instructions in %.3f s (%.1f M/s)\n",
+            p->count, threads, total, elapsed, total / elapsed / 1e6);
+#ifdef DUOVM_PROFILE
+    prof_report(p->prof, stderr, prof_folded_path);
+    prof_free(p->prof);
+#endif
+#ifdef DUOVM_MEM_STATS
+    heat_report(NULL, 0);
+#endif
+    free(p->results);
+    return failed;
+}
+
+/* ================= Fuzzing ================= */
+
+/*
+ * Random button sequences against the loaded program on every core.  Each
+ * worker owns one machine that catches traps, rewinds it to the start
+ * snapshot for every input and takes the next input number from a shared
+ * counter, so a worker finished early just takes more.  Input i of a
+ * seed is always the same keys, so one can be regenerated to report it.
+ * Coverage marks the addresses of every translated block entered.
+ */
+#define FUZZ_KEYS   64          /* most buttons in one input */
+#define FUZZ_QUIET  10000000L   /* instructions without input that make a runaway */
+#define FUZZ_SAMPLE 4096        /* instructions watched to name a runaway's loop */
+
+struct fuzz_result {
+    int       input;
+    int       keys;             /* buttons it got to read */
+    long long executed;
+    uint8_t   trap;
+    uint16_t  pc, addr;
+};
+
+struct fuzz {
+    DuoROM *rom;
+    const uint8_t *start;       /* snapshot every input starts from */
+    size_t start_len;
+    long long max_steps;        /* per input, 0 for no limit */
+    uint64_t seed;
+    int count;
+    atomic_int next;
+    struct fuzz_result *results;
+    uint8_t cover[MEM_SIZE];    /* every worker's coverage, or'd together */
+    pthread_mutex_t cover_lock;
+};
+
+static uint64_t splitmix64(uint64_t *s) {
+    uint64_t z = (*s += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/* Fill keys with input i of seed: 1 to FUZZ_KEYS buttons; returns the count */
+static int fuzz_keys(uint64_t seed, int i, uint8_t *keys) {
+    uint64_t s = seed + (uint64_t)i * 0xD1B54A32D192ED03ULL;
+    int n = 1 + splitmix64(&s) % FUZZ_KEYS;
+    uint64_t r = 0;
+    for (int k = 0; k < n; k++, r >>= 2) {
+        if (k % 32 == 0)
+            r = splitmix64(&s);
+        keys[k] = r & 3;
+    }
+    return n;
+}
+
+/*
+ * Feed keys to vm one per input read, as a -i script would, until they run
+ * out, it halts or traps, or max_steps pass.  A machine that goes
+ * FUZZ_QUIET instructions without reading input or halting has run away.
+ * Its trap PC is the lowest one it passes in the next FUZZ_SAMPLE
+ * instructions, usually the head of the loop it is stuck in, so inputs
+ * lost in the same loop end up with the same PC.
+ */
+static void fuzz_input(DuoVM *vm, const uint8_t *keys, int nkeys, long long max_steps,
+                       struct fuzz_result *r) {
+    long long executed = 0, quiet = 0;
+    int next = 0;
+
+    while (vm->running) {
+        long burst = RUN_BURST;
+        if (max_steps && max_steps - executed < burst)
+            burst = max_steps - executed;
+        double t0 = now_sec();
+        long n = run(vm, burst);
+        vm->run_time += now_sec() - t0;
+        vm->executed += n;
+        executed += n;
+        quiet += n;
+        if (metrics_due(vm))
+            metrics_line(stderr, "fuzzer", vm, 0);
+        if ((vm->stop & STOP_TRAP) || (max_steps && executed >= max_steps))
+            break;
+        if (vm->stop & STOP_INPUT) {
+            if (next == nkeys)
+                break;
+            vm_feed_button(vm, keys[next++]);
+            quiet = 0;
+        } else if (idle_loop(vm)) {
+            vm->halted = true;
+            break;
+        } else if (quiet >= FUZZ_QUIET) {
+            uint16_t low = vm->PC;
+            for (int k = 0; k < FUZZ_SAMPLE && !vm->stop; k++) {
+                executed += run(vm, 1);
+                if (vm->PC < low)
+                    low = vm->PC;
+            }
+            if (!vm->stop)
+                vm_trap(vm, TRAP_RUNAWAY, low, 0);
+        }
+    }
+    r->keys = next;
+    r->executed = executed;
+    r->trap = vm->trap;
+    r->pc = vm->trap_pc;
+    r->addr = vm->trap_addr;
+}
+
+static void *fuzz_worker(void *arg) {
+    struct fuzz *f = arg;
+    DuoVM *vm = vm_new(f->rom);
+    uint8_t keys[FUZZ_KEYS];
+    int i;
+
+    vm->catch_traps = true;
+    vm->cover = xcalloc(1, MEM_SIZE);
+    while ((i = atomic_fetch_add(&f->next, 1)) < f->count) {
+        vm_restore(vm, f->start, f->start_len);
+        f->results[i].input = i;
+        fuzz_input(vm, keys, fuzz_keys(f->seed, i, keys), f->max_steps, &f->results[i]);
+    }
+
+    pthread_mutex_lock(&f->cover_lock);
+    for (int a = 0; a < MEM_SIZE; a++)
+        f->cover[a] |= vm->cover[a];
+    pthread_mutex_unlock(&f->cover_lock);
+    free(vm->cover);
+    vm_free(vm);
+    return NULL;
+}
+
+/* Trapped inputs grouped by trap and PC, earliest input first */
+static int fuzz_by_trap(const void *a, const void *b) {
+    const struct fuzz_result *x = a, *y = b;
+    if (x->trap != y->trap)
+        return x->trap - y->trap;
+    if (x->pc != y->pc)
+        return x->pc - y->pc;
+    return x->input - y->input;
+}
+
+/* Address ranges executed, one "XXXX-YYYY" line each */
+static void save_coverage(const uint8_t *cover, const char *path) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        perror(path);
+        exit(1);
+    }
+    for (uint32_t a = 0; a < MEM_SIZE; a++) {
+        if (!cover[a])
+            continue;
+        uint32_t start = a;
+        while (a + 1 < MEM_SIZE && cover[a + 1])
+            a++;
+        fprintf(f, "%04X-%04X\n", start, a);
+    }
+    if (fclose(f)) {
+        perror(path);
+        exit(1);
+    }
+}
+
+/*
+ * Run f->count inputs and print one line per distinct trap, with how many
+ * inputs hit it and the keys the first one read before trapping, ready to
+ * replay with -i.  Returns the number of distinct traps.
+ */
+static int run_fuzz(struct fuzz *f, int threads, const char *cover_path) {
+    f->results = xcalloc(f->count, sizeof(*f->results));
+    atomic_init(&f->next, 0);
+    pthread_mutex_init(&f->cover_lock, NULL);
+
+    double t0 = now_sec();
+    run_workers(fuzz_worker, f, threads);
+    double elapsed = now_sec() - t0;
+
+    long long total = 0;
+    int trapped = 0, distinct = 0, covered = 0;
+    for (int i = 0; i < f->count; i++) {
+        total += f->results[i].executed;
+        if (f->results[i].trap)
+            f->results[trapped++] = f->results[i];
+    }
+    qsort(f->results, trapped, sizeof(*f->results), fuzz_by_trap);
+    for (int i = 0; i < trapped; ) {
+        const struct fuzz_result *r = &f->results[i];
+        int j = i;
+        while (j < trapped && f->results[j].trap == r->trap && f->results[j].pc == r->pc)
+            j++;
+
+        uint8_t keys[FUZZ_KEYS];
+        fuzz_keys(f->seed, r->input, keys);
+        describe_trap(stdout, r->trap, r->pc, r->addr);
+        printf(": %d input%s, first #%d: ", j - i, j - i == 1 ? "" : "s", r->input);
+        for (int k = 0; k < r->keys; k++)
+            putchar(TRACE_KEYS[keys[k]]);
+        putchar('\n');
+        distinct++;
+        i = j;
+    }
+
+    /* The static CFG says how much ROM code there is to cover */
+    struct cfg *g = cfg_build(f->rom->image, f->rom->entry);
+    int code_covered = 0;
+    for (int a = 0; a < MEM_SIZE; a++) {
+        covered += f->cover[a] != 0;
+        if (a < SRAM_START && (g->flags[a] & (CFG_INSN | CFG_OPERAND)))
+            code_covered += f->cover[a] != 0;
+    }
+    if (cover_path)
+        save_coverage(f->cover, cover_path);
+    fprintf(stderr, "%d inputs (seed %llu) on %d threads: %lld instructions in %.3f s (%.1f M/s)\n",
+            f->count, (unsigned long long)f->seed, threads, total, elapsed, total / elapsed / 1e6);
+    fprintf(stderr, "%d addresses executed (%d of the %zu ROM code bytes the CFG reaches), "
+            "%d inputs trapped, %d distinct traps\n",
+            covered, code_covered, g->code_bytes, trapped, distinct);
+    cfg_free(g);
+    free(f->results);
+    return distinct;
+}
+
+/* ================= Debugger ================= */
+
+/*
+ * -g runs the machine headless under a command prompt on stdin.  A ROM
+ * breakpoint is patched into the machine's own copy of the decode array
+ * (see PRE_BREAK), which only the interpreter reads, so while one is set
+ * the machine runs interpreted.  With none it keeps translated, native
+ * and recompiled code.  A watchpoint marks its page PAGE_WATCH, so that
+ * only stores to that page leave mem_write()'s fast path, in every mode.
+ * SRAM has no decoded code to patch, so while a breakpoint is set there,
+ * the machine runs one instruction at a time.  Traps stop the machine
+ * instead of the process.
+ */
+struct debugger {
+    DuoVM *vm;
+    struct predecode *code;     /* vm->code */
+    uint8_t breaks[MEM_SIZE];
+    uint8_t watch[MEM_SIZE];    /* vm->watch */
+    int rom_breaks, sram_breaks;
+    bool tc, aot;               /* use_tc and use_aot as -g found them */
+};
+
+static const char dbg_help[] =
+    "b [ADDR]     break at ADDR, or list breakpoints and watchpoints\n"
+    "w ADDR       stop after every store to SRAM address ADDR\n"
+    "d ADDR       delete the breakpoint or watchpoint at ADDR\n"
+    "c            continue until something stops the machine\n"
+    "s [N]        run N instructions (default 1)\n"
+    "r            show the registers\n"
+    "x ADDR [N]   dump N bytes of memory from ADDR (default 16)\n"
+    "p            print the screen\n"
+    "k KEYS       queue buttons (a/w/s/d) for the program to read\n"
+    "q            quit\n"
+    "Addresses are hex.  An empty line repeats the last s or c.\n";
+
+static void dbg_show_insn(DuoVM *vm, uint16_t pc) {
+    disasm(stdout, vm->memory, pc);
+    putchar('\n');
+}
+
+static void dbg_show_regs(DuoVM *vm) {
+    printf("PC=%04X A=%04X T=%04X D0=%02X D1=%02X C=%d cursor=%d,%d  %llu instructions, %llu cycles\n",
+           vm->PC, vm->A, vm->T, vm->D0, vm->D1, carry(vm), vm->cur_x, vm->cur_y,
+           (unsigned long long)vm->icount, (unsigned long long)vm->cycles);
+}
+
+/* Why the machine stopped, and where it is now */
+static void dbg_report(DuoVM *vm) {
+    if (vm->stop & STOP_BREAK)
+        printf("breakpoint\n");
+    if (vm->stop & STOP_WATCH)
+        printf("watchpoint %04X: %02X -> %02X at %04X\n", vm->watch_addr, vm->watch_old,
+               vm->memory[vm->watch_addr], vm->watch_pc);
+    if (vm->stop & STOP_TRAP) {
+        describe_trap(stdout, vm->trap, vm->trap_pc, vm->trap_addr);
+        putchar('\n');
+    } else if (vm->halted) {
+        printf("halted\n");
+    } else if (!vm->running) {
+        printf("out of input; queue buttons with k\n");
+    }
+    dbg_show_insn(vm, vm->PC);
+}
+
+static void dbg_set_break(struct debugger *d, uint16_t addr, bool on) {
+    if (d->breaks[addr] == on)
+        return;
+    d->breaks[addr] = on;
+    if (addr < SRAM_START) {
+        d->code[addr] = on ? break_entry : d->vm->rom->code[addr];
+        d->rom_breaks += on ? 1 : -1;
+    } else {
+        d->sram_breaks += on ? 1 : -1;
+    }
+}
+
+static void dbg_set_watch(struct debugger *d, uint16_t addr, bool on) {
+    uint16_t page = addr >> PAGE_SHIFT;
+    d->watch[addr] = on;
+    d->vm->page_flags[page] &= ~PAGE_WATCH;
+    for (int i = 0; i < 1 << PAGE_SHIFT; i++) {
+        if (d->watch[page << PAGE_SHIFT | i])
+            d->vm->page_flags[page] |= PAGE_WATCH;
+    }
+}
+
+/* Run up to n instructions, or with n = 0 until something stops the machine */
+static void dbg_run(struct debugger *d, long long n) {
+    DuoVM *vm = d->vm;
+    long long done = 0, steps = 0;
+
+    vm->stop &= ~(STOP_BREAK | STOP_WATCH);
+    use_tc = d->tc && !d->rom_breaks;
+    use_aot = d->aot && !d->rom_breaks;
+    /* Get off a breakpoint at PC by running its own instruction once */
+    if (vm->running && d->breaks[vm->PC]) {
+        uint16_t pc = vm->PC;
+        if (pc < SRAM_START)
+            d->code[pc] = vm->rom->code[pc];
+        done = run_machine(vm, 1);
+        if (pc < SRAM_START)
+            d->code[pc] = break_entry;
+    }
+    if (!d->sram_breaks) {
+        if (vm->running && !(vm->stop & (STOP_BREAK | STOP_WATCH)) && (!n || done < n))
+            run_machine(vm, n ? n - done : 0);
+    } else {
+        /* run_machine() can't look for a halt a step at a time; do it here */
+        while (vm->running && !(vm->stop & (STOP_BREAK | STOP_WATCH)) && (!n || done < n)) {
+            if (vm->PC >= SRAM_START && d->breaks[vm->PC]) {
+                vm->stop |= STOP_BREAK;
+                break;
+            }
+            done += run_machine(vm, 1);
+            if (++steps % 4096 == 0 && idle_loop(vm)) {
+                vm->running = false;
+                vm->halted = true;
+            }
+        }
+    }
+    dbg_report(vm);
+}
+
+static bool dbg_addr(const char *arg, uint16_t *addr, char **end) {
+    unsigned long a = strtoul(arg, end, 16);
+    if (*end == arg || a >= MEM_SIZE) {
+        printf("bad address\n");
+        return false;
+    }
+    *addr = a;
+    return true;
+}
+
+static void run_debugger(DuoVM *vm) {
+    struct debugger *d = xcalloc(1, sizeof(*d));
+    char line[256], last[256] = "";
+
+    d->vm = vm;
+    d->code = xcalloc(SRAM_START, sizeof(*d->code));
+    memcpy(d->code, vm->rom->code, SRAM_START * sizeof(*d->code));
+    vm->code = d->code;
+    vm->watch = d->watch;
+    d->tc = use_tc;
+    d->aot = use_aot;
+    vm->catch_traps = true;
+
+    dbg_show_insn(vm, vm->PC);
+    for (;;) {
+        printf("(duovm) ");
+        fflush(stdout);
+        if (!fgets(line, sizeof(line), stdin))
+            break;
+        if (line[strspn(line, " \t\n")] == '\0')
+            strcpy(line, last);
+
+        char cmd[16], *arg, *end;
+        int off;
+        uint16_t addr;
+        if (sscanf(line, " %15s %n", cmd, &off) != 1)
+            continue;
+        arg = line + off;
+
+        if (!strcmp(cmd, "q")) {
+            break;
+        } else if (!strcmp(cmd, "c") || !strcmp(cmd, "s")) {
+            long long n = cmd[0] == 's' ? 1 : 0;
+            if (cmd[0] == 's' && *arg && (n = strtoll(arg, NULL, 10)) <= 0) {
+                printf("bad count\n");
+                continue;
+            }
+            strcpy(last, line);
+            dbg_run(d, n);
+        } else if (!strcmp(cmd, "b") && !*arg) {
+            for (uint32_t a = 0; a < MEM_SIZE; a++) {
+                if (d->breaks[a])
+                    printf("break %04X\n", a);
+                if (d->watch[a])
+                    printf("watch %04X\n", a);
+            }
+        } else if (!strcmp(cmd, "b")) {
+            if (dbg_addr(arg, &addr, &end))
+                dbg_set_break(d, addr, true);
+        } else if (!strcmp(cmd, "w")) {
+            if (!dbg_addr(arg, &addr, &end))
+                continue;
+            if (addr < SRAM_START)
+                printf("%04X is ROM, which nothing can store to\n", addr);
+            else
+                dbg_set_watch(d, addr, true);
+        } else if (!strcmp(cmd, "d")) {
+            if (!dbg_addr(arg, &addr, &end))
+                continue;
+            if (!d->breaks[addr] && !d->watch[addr])
+                printf("nothing set at %04X\n", addr);
+            dbg_set_break(d, addr, false);
+            if (d->watch[addr])
+                dbg_set_watch(d, addr, false);
+        } else if (!strcmp(cmd, "r")) {
+            dbg_show_regs(vm);
+        } else if (!strcmp(cmd, "x")) {
+            if (!dbg_addr(arg, &addr, &end))
+                continue;
+            long n = strtol(end, NULL, 10);
+            if (n <= 0)
+                n = 16;
+            for (long i = 0; i < n; i++) {
+                uint16_t a = addr + i;
+                if (i % 16 == 0)
+                    printf(i ? "\n%04X " : "%04X ", a);
+                printf(" %02X", vm->memory[a]);
+            }
+            putchar('\n');
+        } else if (!strcmp(cmd, "p")) {
+            dump_screen(vm, stdout);
+        } else if (!strcmp(cmd, "k")) {
+            for (; *arg && *arg != '\n'; arg++) {
+                int b = key_button(*arg);
+                if (b < 0)
+                    continue;
+                if (!vm_feed_button(vm, b)) {
+                    printf("button queue is full\n");
+                    break;
+                }
+                /* A machine that ran out of input can go on */
+                if (!vm->halted && !(vm->stop & STOP_TRAP))
+                    vm->running = true;
+            }
+        } else {
+            fputs(dbg_help, stdout);
+        }
+    }
+
+    vm->code = vm->rom->code;
+    vm->watch = NULL;
+    for (uint32_t p = SRAM_START >> PAGE_SHIFT; p < PAGE_COUNT; p++)
+        vm->page_flags[p] &= ~PAGE_WATCH;
+    free(d->code);
+    free(d);
+}
+
+/* ================= Remote display ================= */
+
+/*
+ * -l [HOST:]PORT serves Navigator sessions over TCP: every connection
+ * gets a machine of its own, booted from the program (or -R), and one
+ * thread runs them all around poll().  Both directions are plain bytes:
+ *
+ *   server: "DUOVM 1 36 24\n", then frames
+ *   frame:  'F', run count (2 bytes, little-endian), then for each run
+ *           its row, column and length (a byte each) and that many cells
+ *   client: buttons, as keys in a script (a/w/s/d, Enter for d); any
+ *           other byte is ignored
+ *
+ * Cells are the Navigator's own bytes (0x7F is the solid block), and a
+ * client starts from a blank screen.  A frame holds only the cells that
+ * differ from what the client was last sent, with gaps of up to three
+ * unchanged cells folded into the run around them, since a new run costs
+ * three bytes.  Frames go out at most FRAME_RATE times a second, and
+ * whenever a machine parks on input, so a client always sees the screen
+ * its program waits on.  Nothing blocks: output queues per session, and
+ * a client that falls behind gets no new frames until it has caught up,
+ * so its next frame covers everything it missed.  A session whose program
+ * halts or traps stays connected, showing the last screen.
+ */
+#define NET_SESSIONS  256
+#define NET_HELLO     "DUOVM 1 36 24\n"
+#define NET_FRAME_MAX (3 + SCREEN_H * (3 + SCREEN_W))
+#define NET_OUT       (4 * NET_FRAME_MAX)
+
+struct session {
+    int fd;
+    int id;
+    DuoVM *vm;
+    bool waiting;                       /* parked on input with no button queued */
+    double waiting_since;
+    uint8_t sent[SCREEN_H][SCREEN_W];   /* the client's screen */
+    struct timespec last_frame;
+    size_t out_len;
+    uint8_t out[NET_OUT];
+};
+
+static bool net_changed(const DuoVM *vm, const struct session *s, int y, int x) {
+    return (vm->dirty[y] >> x & 1) && vm->screen[y][x] != s->sent[y][x];
+}
+
+/* Queue a frame of the dirty cells, unless the client is too far behind */
+static void net_flush(DuoVM *vm) {
+    struct session *s = vm->session;
+    if (s->out_len + NET_FRAME_MAX > sizeof(s->out))
+        return;
+
+    uint8_t *frame = s->out + s->out_len, *p = frame + 3;
+    unsigned runs = 0;
+    for (int y = 0; y < SCREEN_H; y++) {
+        for (int x = 0; x < SCREEN_W; ) {
+            if (!net_changed(vm, s, y, x)) {
+                x++;
+                continue;
+            }
+            int end = x + 1;
+            for (int k = end; k < SCREEN_W && k - end < 3; k++) {
+                if (net_changed(vm, s, y, k))
+                    end = k + 1;
+            }
+            *p++ = y;
+            *p++ = x;
+            *p++ = end - x;
+            memcpy(p, &vm->screen[y][x], end - x);
+            memcpy(&s->sent[y][x], &vm->screen[y][x], end - x);
+            p += end - x;
+            runs++;
+            x = end;
+        }
+        vm->dirty[y] = 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &s->last_frame);
+    if (!runs)
+        return;
+    vm->flushes++;
+    frame[0] = 'F';
+    frame[1] = runs & 0xFF;
+    frame[2] = runs >> 8;
+    s->out_len = p - s->out;
+}
+
+static const struct display display_net = {
+    NULL, NULL, net_flush, no_button,
+};
+
+static bool net_dirty(const DuoVM *vm) {
+    for (int y = 0; y < SCREEN_H; y++) {
+        if (vm->dirty[y])
+            return true;
+    }
+    return false;
+}
+
+/* Nanoseconds until s is due a frame, 0 if it is already */
+static long long net_frame_due(const struct session *s, const struct timespec *now) {
+    long long ns = (now->tv_sec - s->last_frame.tv_sec) * 1000000000LL +
+                   (now->tv_nsec - s->last_frame.tv_nsec);
+    long long wait = 1000000000LL / FRAME_RATE - ns;
+    return wait > 0 ? wait : 0;
+}
+
+/* Listening socket for "PORT" (on loopback) or "HOST:PORT" */
+static int net_listen(const char *where) {
+    struct sockaddr_in sa = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    const char *colon = strrchr(where, ':');
+    char host[64];
+
+    if (colon) {
+        size_t n = colon - where;
+        if (n < sizeof(host)) {
+            memcpy(host, where, n);
+            host[n] = '\0';
+        }
+        if (n >= sizeof(host) || inet_pton(AF_INET, host, &sa.sin_addr) != 1) {
+            fprintf(stderr, "-l: bad address %s (want PORT or A.B.C.D:PORT)\n", where);
+            exit(1);
+        }
+        where = colon + 1;
+    }
+    sa.sin_port = htons(atoi(where));
+
+    int one = 1, fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+        bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 || listen(fd, 64) < 0) {
+        perror("-l");
+        exit(1);
+    }
+    return fd;
+}
+
+static struct session *net_accept(int lfd, DuoROM *rom, const uint8_t *snapshot,
+                                  size_t snapshot_len, int id) {
+    int one = 1, fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    struct session *s = xcalloc(1, sizeof(*s));
+    s->fd = fd;
+    s->id = id;
+    s->vm = vm_new(rom);
+    if (snapshot)
+        vm_restore(s->vm, snapshot, snapshot_len);
+    s->vm->catch_traps = true;
+    s->vm->session = s;
+    memset(s->sent, ' ', sizeof(s->sent));
+    for (int y = 0; y < SCREEN_H; y++)
+        s->vm->dirty[y] = (1ULL << SCREEN_W) - 1;
+    memcpy(s->out, NET_HELLO, strlen(NET_HELLO));
+    s->out_len = strlen(NET_HELLO);
+    fprintf(stderr, "session %d: connected\n", id);
+    return s;
+}
+
+static void net_close(struct session *s) {
+    fprintf(stderr, "session %d: closed after %llu instructions\n", s->id,
+            (unsigned long long)s->vm->icount);
+    close(s->fd);
+#ifdef DUOVM_MEM_STATS
+    heat_retire(s->vm);
+#endif
+    vm_free(s->vm);
+    free(s);
+}
+
+static size_t net_room(const DuoVM *vm) {
+    return KEYQ_SIZE - (uint8_t)(vm->keyq_tail - vm->keyq_head);
+}
+
+/* Read buttons and send queued output; false once the client is gone */
+static bool net_io(struct session *s, short revents) {
+    if (revents & POLLIN) {
+        /* No more than fit in the queue; the rest waits in the socket */
+        uint8_t buf[KEYQ_SIZE];
+        ssize_t n = recv(s->fd, buf, net_room(s->vm), 0);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+            return false;
+        for (ssize_t i = 0; i < n; i++) {
+            int b = key_button(buf[i]);
+            if (b >= 0 && vm_feed_button(s->vm, b) && s->waiting) {
+                s->waiting = false;
+                s->vm->wait_time += now_sec() - s->waiting_since;
+            }
+        }
+    } else if (revents & (POLLHUP | POLLERR)) {
+        return false;
+    }
+    if (s->out_len) {
+        ssize_t n = send(s->fd, s->out, s->out_len, MSG_NOSIGNAL);
+        if (n < 0 && errno != EAGAIN && errno != EINTR)
+            return false;
+        if (n > 0) {
+            memmove(s->out, s->out + n, s->out_len - n);
+            s->out_len -= n;
+        }
+    }
+    return true;
+}
+
+/* One burst of run_machine() for a session's machine */
+static void net_run(struct session *s) {
+    DuoVM *vm = s->vm;
+    double t0 = now_sec();
+    long n = run(vm, RUN_BURST);
+    vm->run_time += now_sec() - t0;
+    vm->icount += n;
+    vm->executed += n;
+
+    if (vm->stop & STOP_TRAP) {
+        fprintf(stderr, "session %d: ", s->id);
+        describe_trap(stderr, vm->trap, vm->trap_pc, vm->trap_addr);
+        fputc('\n', stderr);
+    } else if (vm->stop & STOP_INPUT) {
+        s->waiting = vm->keyq_head == vm->keyq_tail;
+        if (s->waiting) {
+            s->waiting_since = now_sec();
+            net_flush(vm);
+        }
+    } else if (idle_loop(vm)) {
+        vm->running = false;
+        vm->halted = true;
+    }
+    if (!vm->running)
+        net_flush(vm);
+}
+
+/* A metrics line per session, then how busy the server's thread is */
+static void net_metrics(struct session *const *sessions, int count, double started, double busy) {
+    double now = now_sec(), run_time = 0;
+    uint64_t executed = 0;
+    for (int i = 0; i < count; i++) {
+        const struct session *s = sessions[i];
+        char who[32];
+        snprintf(who, sizeof(who), "session %d", s->id);
+        metrics_line(stderr, who, s->vm, s->waiting ? now - s->waiting_since : 0);
+        executed += s->vm->executed;
+        run_time += s->vm->run_time;
+    }
+    fprintf(stderr, "server: %d session%s, %.1f M/s running, %.1f%% of the thread busy\n",
+            count, count == 1 ? "" : "s", run_time > 0 ? executed / run_time / 1e6 : 0.0,
+            100 * busy / (now - started));
+}
+
+static void run_server(DuoROM *rom, const char *where, const uint8_t *snapshot, size_t snapshot_len) {
+    static struct session *sessions[NET_SESSIONS];
+    static struct pollfd pfd[NET_SESSIONS + 2];
+    int lfd = net_listen(where), count = 0, ids = 0;
+    unsigned metrics_seen = atomic_load_explicit(&metrics_asked, memory_order_relaxed);
+    double started = now_sec(), busy = 0;
+
+    fprintf(stderr, "serving on %s\n", where);
+    for (;;) {
+        struct timespec now;
+        long long timeout = -1;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        pfd[0] = (struct pollfd){ .fd = count < NET_SESSIONS ? lfd : -1, .events = POLLIN };
+        for (int i = 0; i < count; i++) {
+            struct session *s = sessions[i];
+            pfd[i + 1] = (struct pollfd){
+                .fd = s->fd, .events = (net_room(s->vm) ? POLLIN : 0) | (s->out_len ? POLLOUT : 0)
+            };
+            if (s->vm->running && !s->waiting)
+                timeout = 0;
+            else if (net_dirty(s->vm) && s->out_len + NET_FRAME_MAX <= sizeof(s->out)) {
+                long long ms = (net_frame_due(s, &now) + 999999) / 1000000;
+                if (timeout < 0 || ms < timeout)
+                    timeout = ms;
+            }
+        }
+        int nfds = count + 1;
+#ifdef DUOVM_MEM_STATS
+        if (heat_fd >= 0)
+            pfd[nfds++] = (struct pollfd){ .fd = heat_fd, .events = POLLIN };
+#endif
+        if (poll(pfd, nfds, timeout) < 0 && errno != EINTR) {
+            perror("poll");
+            exit(1);
+        }
+#ifdef DUOVM_MEM_STATS
+        if (nfds > count + 1 && (pfd[count + 1].revents & POLLIN)) {
+            DuoVM *live[NET_SESSIONS];
+            for (int i = 0; i < count; i++)
+                live[i] = sessions[i]->vm;
+            heat_serve(live, count);
+        }
+#endif
+
+        for (int i = 0; i < count; i++) {
+            if (!net_io(sessions[i], pfd[i + 1].revents)) {
+                net_close(sessions[i]);
+                sessions[i] = sessions[--count];
+                pfd[i + 1] = pfd[count + 1];
+                i--;
+            }
+        }
+        if (pfd[0].revents & POLLIN) {
+            struct session *s;
+            while (count < NET_SESSIONS &&
+                   (s = net_accept(lfd, rom, snapshot, snapshot_len, ids)) != NULL) {
+                sessions[count++] = s;
+                ids++;
+            }
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double t0 = now_sec();
+        for (int i = 0; i < count; i++) {
+            struct session *s = sessions[i];
+            if (s->vm->running && !s->waiting)
+                net_run(s);
+            if (net_dirty(s->vm) && !net_frame_due(s, &now))
+                net_flush(s->vm);
+        }
+        busy += now_sec() - t0;
+
+        unsigned asked = atomic_load_explicit(&metrics_asked, memory_order_relaxed);
+        if (asked != metrics_seen) {
+            metrics_seen = asked;
+            net_metrics(sessions, count, started, busy);
+        }
+    }
+}
+
+/* ================= Main ================= */
+
+static char *read_file(const char *path, size_t *len) {
+    FILE *f = strcmp(path, "-") ? fopen(path, "rb") : stdin;
+    if (!f) {
+        perror(path);
+        exit(1);
+    }
+
+    size_t cap = 4096, n = 0, r;
+    char *buf = malloc(cap);
+    while (buf && (r = fread(buf + n, 1, cap - n, f)) > 0) {
+        n += r;
+        if (n == cap)
+            buf = realloc(buf, cap *= 2);
+    }
+    if (!buf) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    if (f != stdin)
+        fclose(f);
+    *len = n;
+    return buf;
+}
+
+#ifdef DUOVM_PROFILE
+#define PROFILE_OPTS "P:"
+#else
+#define PROFILE_OPTS ""
+#endif
+
+#ifdef DUOVM_EXEC_TRACE
+#define XTRACE_OPTS "x:"
+#else
+#define XTRACE_OPTS ""
+#endif
+
+#ifdef DUOVM_MEM_STATS
+#define MEM_STATS_OPTS "M:m:"
+#else
+#define MEM_STATS_OPTS ""
+#endif
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [options] program.hex\n"
+            "  -H         headless: no terminal, dump the screen at exit\n"
+            "  -i FILE    input script (keystrokes) or trace, played before the\n"
+            "             keyboard takes over; '-' for stdin; repeat to hand pool\n"
+            "             machines different scripts\n"
+            "  -r FILE    record every button the program reads as a trace\n"
+            "  -d         headless: print changed rows at every input read\n"
+            "  -n STEPS   stop after STEPS instructions\n"
+            "  -s RATE    run at most RATE instructions per second (e.g. 2e6)\n"
+            "  -N COUNT   run COUNT headless machines and print a line for each\n"
+            "  -j THREADS worker threads for -N and -F (default: one per CPU)\n"
+            "  -l ADDR    serve a session per TCP connection on [HOST:]PORT\n"
+            "             (host 127.0.0.1 unless given)\n"
+            "  -L LANES   machines each -N thread runs in lockstep (1-16; default 16,\n"
+            "             or 1 where hot code is compiled to machine code)\n"
+            "  -F COUNT   fuzz: run COUNT random key sequences, each from the\n"
+            "             start (or -R) state, and report every distinct trap\n"
+            "  -z SEED    random seed for -F (default 1)\n"
+            "  -C FILE    with -F, write the address ranges executed to FILE\n"
+            "  -I         interpret every instruction (no translation cache)\n"
+            "  -g         debug: run headless under a command prompt on stdin\n"
+            "  -c OUT     convert the program to a binary image OUT and exit\n"
+            "  -A OUT     recompile the program's ROM to C source OUT and exit\n"
+            "  -D         disassemble the program's ROM along its control flow and exit\n"
+            "  -b         run the benchmarks (dispatch, loader, the program with\n"
+            "             the -i scripts, screen flush) and exit\n"
+#ifdef DUOVM_PROFILE
+            "  -P FILE    write folded profile stacks to FILE (default duovm.folded)\n"
+#endif
+#ifdef DUOVM_EXEC_TRACE
+            "  -x FILE    write an execution trace of the machine to FILE\n"
+#endif
+#ifdef DUOVM_MEM_STATS
+            "  -M FILE    write the memory heatmap to FILE at exit (default duovm.heat)\n"
+            "  -m PATH    hand the heatmap so far to each client of Unix socket PATH\n"
+#endif
+            "  -X FILE    print execution trace FILE and exit (no program needed)\n"
+            "  -R FILE    start from snapshot FILE instead of booting\n"
+            "  -S FILE    save a snapshot of the machine to FILE when it stops\n"
+            "\n"
+            "program may be a .hex file or a binary image made with -c.\n",
+            prog);
+}
+
+int main(int argc, char **argv) {
+    static uint8_t image[MEM_SIZE];
+    static struct fuzz fuzz = { .seed = 1 };
+    struct pool pool = { .lanes = LANES_DEFAULT };
+    long long max_steps = 0;
+    const char *image_out = NULL, *aot_out = NULL, *snapshot_in = NULL, *snapshot_out = NULL;
+    const char *record_path = NULL, *cover_path = NULL, *xtrace_in = NULL, *listen_on = NULL;
+#ifdef DUOVM_EXEC_TRACE
+    const char *xtrace_out = NULL;
+#endif
+    bool bench = false, dump_frames = false, debug = false, disasm_rom = false;
+    int instances = 0, threads = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "Hi:r:dn:s:N:j:L:l:Igc:A:DbR:S:F:z:C:X:" PROFILE_OPTS XTRACE_OPTS MEM_STATS_OPTS)) != -1) {
+        switch (opt) {
+            case 'H': display = &display_headless; break;
+            case 'i': {
+                size_t len;
+                char *buf = read_file(optarg, &len);
+                pool.scripts = realloc(pool.scripts, (pool.nscripts + 1) * sizeof(*pool.scripts));
+                if (!pool.scripts) {
+                    fprintf(stderr, "out of memory\n");
+                    return 1;
+                }
+                pool.scripts[pool.nscripts++] = parse_input(optarg, buf, len);
+                free(buf);
+                break;
+            }
+            case 'r': record_path = optarg; break;
+            case 'd': dump_frames = true; break;
+            case 'n': max_steps = strtoll(optarg, NULL, 0); break;
+            case 's': {
+                /* The rate is whole instructions per second; 0 would mean flat out */
+                char *end;
+                double rate = strtod(optarg, &end);
+                if (end == optarg || *end || !(rate >= 1 && rate <= 1e18)) {
+                    fprintf(stderr, "-s takes a rate of at least 1 instruction per second\n");
+                    return 1;
+                }
+                pace_rate = rate;
+                break;
+            }
+            case 'N': instances = atoi(optarg); break;
+            case 'l': listen_on = optarg; break;
+            case 'j': threads = atoi(optarg); break;
+            case 'L':
+                pool.lanes = atoi(optarg);
+                if (pool.lanes < 1 || pool.lanes > LANES) {
+                    fprintf(stderr, "-L takes 1 to %d\n", LANES);
+                    return 1;
+                }
+                break;
+            case 'I': use_tc = use_aot = false; break;
+            case 'g': debug = true; break;
+            case 'c': image_out = optarg; break;
+            case 'A': aot_out = optarg; break;
+            case 'D': disasm_rom = true; break;
+            case 'b': bench = true; break;
+            case 'R': snapshot_in = optarg; break;
+            case 'S': snapshot_out = optarg; break;
+            case 'F': fuzz.count = atoi(optarg); break;
+            case 'z': fuzz.seed = strtoull(optarg, NULL, 0); break;
+            case 'C': cover_path = optarg; break;
+#ifdef DUOVM_PROFILE
+            case 'P': prof_folded_path = optarg; break;
+#endif
+#ifdef DUOVM_EXEC_TRACE
+            case 'x': xtrace_out = optarg; break;
+#endif
+#ifdef DUOVM_MEM_STATS
+            case 'M': heat_path = optarg; break;
+            case 'm': heat_sock = optarg; break;
+#endif
+            case 'X': xtrace_in = optarg; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (xtrace_in) {
+        decode_xtrace(xtrace_in);
+        return 0;
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    init_cpu();
+    uint16_t entry = load_program(argv[optind], image);
+    if (image_out) {
+        save_image(image_out, image, entry);
+        return 0;
+    }
+    if (disasm_rom) {
+        disassemble(image, entry, stdout);
+        return 0;
+    }
+    DuoROM *rom = rom_new(image, entry);
+    if (aot_out) {
+        recompile(image, entry, rom->rom_hash, argv[optind], aot_out);
+        return 0;
+    }
+#ifdef DUOVM_AOT
+    if (!rom->aot)
+        fprintf(stderr, "%s isn't the program this duovm was recompiled from; interpreting it\n",
+                argv[optind]);
+#endif
+    for (int i = 0; i < pool.nscripts; i++) {
+        if (pool.scripts[i]->timed && pool.scripts[i]->rom_hash != rom->rom_hash)
+            image_error(pool.scripts[i]->path, "trace was recorded with another program");
+    }
+    struct sigaction sa = { .sa_handler = metrics_signal, .sa_flags = SA_RESTART };
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+
+    if (bench) {
+        run_benchmarks(argv[optind], rom, pool.scripts, pool.nscripts);
+        return 0;
+    }
+
+    if (snapshot_in) {
+        pool.snapshot = map_file(snapshot_in, &pool.snapshot_len);
+        DuoVM *probe = vm_new(rom);
+        if (!vm_restore(probe, pool.snapshot, pool.snapshot_len))
+            image_error(snapshot_in, "not a snapshot of this program");
+        vm_free(probe);
+    }
+
+    if (threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0)
+        threads = 1;
+
+    if (fuzz.count > 0) {
+        display = &display_headless;
+        use_tc = true;          /* coverage comes from the translation cache */
+        use_aot = false;
+        fuzz.rom = rom;
+        fuzz.max_steps = max_steps;
+        if (pool.snapshot) {
+            fuzz.start = pool.snapshot;
+            fuzz.start_len = pool.snapshot_len;
+        } else {
+            DuoVM *boot = vm_new(rom);
+            uint8_t *blob;
+            fuzz.start_len = vm_snapshot(boot, &blob);
+            fuzz.start = blob;
+            vm_free(boot);
+        }
+        return run_fuzz(&fuzz, threads < fuzz.count ? threads : fuzz.count, cover_path) ? 1 : 0;
+    }
+
+#ifdef DUOVM_MEM_STATS
+    if (heat_sock)
+        heat_listen();
+#endif
+    if (listen_on) {
+        display = &display_net;
+        run_server(rom, listen_on, pool.snapshot, pool.snapshot_len);
+        return 0;
+    }
+
+    if (instances > 0) {
+        display = &display_headless;
+        pool.rom = rom;
+        pool.max_steps = max_steps;
+        pool.count = instances;
+        return run_pool(&pool, threads < instances ? threads : instances) ? 1 : 0;
+    }
+
+    if (debug)
+        display = &display_headless;
+
+    DuoVM *vm = vm_new(rom);
+    if (pool.snapshot)
+        vm_restore(vm, pool.snapshot, pool.snapshot_len);
+    if (pool.nscripts)
+        vm->trace = pool.scripts[0];
+    if (record_path) {
+        if (!(vm->record = fopen(record_path, "w"))) {
+            perror(record_path);
+            return 1;
+        }
+        fprintf(vm->record, TRACE_MAGIC " %d rom=%08X\n", TRACE_VERSION, rom->rom_hash);
+    }
+    vm->dump_frames = dump_frames && display == &display_headless;
+#ifdef DUOVM_EXEC_TRACE
+    if (xtrace_out)
+        xtrace_open(vm, xtrace_out);
+#endif
+
+    if (display->open)
+        display->open();
+
+    long long executed = 0;
+    if (debug)
+        run_debugger(vm);
+    else
+        executed = run_machine(vm, max_steps);
+    if (vm->halted) {
+        /* Nothing can change any more; show the screen until killed */
+        while (display->button(vm) >= 0)
+            ;
+    }
+
+    shutdown_display();
+#ifdef DUOVM_EXEC_TRACE
+    xtrace_close();
+#endif
+    if (snapshot_out)
+        save_snapshot(vm, snapshot_out);
+    if (vm->record)
+        fclose(vm->record);
+    if (display == &display_headless && !debug && !vm->trace_failed) {
+        if (vm->dump_frames)
+            dump_screen_diff(vm, stdout);
+        else
+            dump_screen(vm, stdout);
+        fprintf(stderr, "%lld instructions, PC=%04X%s\n", executed, vm->PC,
+                vm->halted ? " (halted)" : "");
+    }
+#ifdef DUOVM_PROFILE
+    prof_report(vm->prof, stderr, prof_folded_path);
+#endif
+#ifdef DUOVM_MEM_STATS
+    heat_report(&vm, 1);
+#endif
+    int status = vm->trace_failed ? 1 : 0;
+    vm_free(vm);
+    return status;
 }